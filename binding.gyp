@@ -1,8 +1,24 @@
 {
+  "variables": {
+    "bench%": 0
+  },
   "targets": [
     {
       "target_name": "iptrie",
-      "sources": [ "src/iptrie.cc", "src/btrie.cc" ]
+      "sources": [ "src/iptrie.cc", "src/btrie.cc", "src/btrie_image.cc" ],
+      "defines": [ "NAPI_VERSION=8" ]
     }
+  ],
+  "conditions": [
+    [ "bench==1", {
+      "targets": [
+        {
+          "target_name": "btrie_bench",
+          "type": "executable",
+          "include_dirs": [ "src" ],
+          "sources": [ "test/btrie_bench.cc", "src/btrie.cc" ]
+        }
+      ]
+    } ]
   ]
 }
@@ -1 +1,38 @@
-module.exports = require('./build/Release/iptrie');
+var stream = require('stream'),
+    util = require('util'),
+    binding = require('./build/Release/iptrie');
+
+function Annotator(trie, options) {
+  stream.Transform.call(this);
+  this.trie = trie;
+  this.options = {};
+  this.tail = null;
+  if (options) {
+    if (options.field !== undefined) this.options.field = options.field;
+    if (options.separator !== undefined) this.options.separator = options.separator;
+    if (options.missing !== undefined) this.options.missing = options.missing;
+  }
+}
+util.inherits(Annotator, stream.Transform);
+
+Annotator.prototype._transform = function(chunk, encoding, done) {
+  if (!Buffer.isBuffer(chunk)) chunk = Buffer.from(chunk, encoding);
+  if (this.tail) chunk = Buffer.concat([this.tail, chunk]);
+  /* hold back a line split across chunks */
+  var eol = chunk.lastIndexOf(10);
+  this.tail = eol + 1 < chunk.length ? chunk.slice(eol + 1) : null;
+  if (eol >= 0) this.push(this.trie.annotate(chunk.slice(0, eol + 1), this.options));
+  done();
+};
+
+Annotator.prototype._flush = function(done) {
+  if (this.tail) this.push(this.trie.annotate(this.tail, this.options));
+  this.tail = null;
+  done();
+};
+
+binding.IPTrie.prototype.annotateStream = function(options) {
+  return new Annotator(this, options);
+};
+
+module.exports = binding;
@@ -30,7 +30,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include "btrie.h"
+#include "btrie_int.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,223 +38,820 @@
 #include <stdint.h>
 #include <arpa/inet.h>
 #include <assert.h>
-// BITS should be either 32 or 128
-#define MAXBITS 128
 
-typedef struct btrie_collapsed_node {
-  struct btrie_collapsed_node *bit[2];
-  void *data;
-  uint32_t bits[MAXBITS/32];
-  unsigned char prefix_len;
-  unsigned char incidental;
 #ifdef DEBUG_BTRIE
-  char *long_desc;
+template <int W>
+static void describe(typename btrie_key<W>::type key, char *ipb, size_t len) {
+  uint32_t w[4] = { 0, 0, 0, 0 };
+  int i;
+  btrie_key<W>::to_words(key, w);
+  for(i=0;i<4;i++) w[i] = htonl(w[i]);
+  inet_ntop(W == 32 ? AF_INET : AF_INET6, w, ipb, len);
+}
+template <int W>
+static void describe_node(btrie_collapsed_node<W> *node) {
+  char ipb[128];
+  describe<W>(node->key, ipb, sizeof(ipb));
+  node->long_desc = strdup(ipb);
+}
 #endif
-} btrie_node;
 
-#define BIT_AT(k,b) ((k[(b-1)/32] >> (31 - ((b-1)%32))) & 0x1)
-
-static void drop_node(btrie_node *node, void (*f)(void *)) {
-  if(node == NULL) return;
-  if(node->bit[0]) drop_node(node->bit[0], f);
-  if(node->bit[1]) drop_node(node->bit[1], f);
-  if(node->data && f) f(node->data);
+/* Node pool; see btrie_int.h for the slab layout. */
+template <int W>
+static btrie_collapsed_node<W> *alloc_node(btrie_tree<W> *tree) {
+  typedef btrie_collapsed_node<W> node_t;
+  node_t *node;
+  if(tree->free_nodes) {
+    node = tree->free_nodes;
+    tree->free_nodes = node->bit[0];
+    tree->nfree--;
+  }
+  else {
+    if(!tree->slabs || tree->slabs->used == SLAB_NODES) {
+      btrie_slab<W> *slab = (btrie_slab<W> *)malloc(sizeof(*slab));
+      slab->next = tree->slabs;
+      slab->used = 0;
+      tree->slabs = slab;
+      tree->nslabs++;
+    }
+    node = &tree->slabs->nodes[tree->slabs->used++];
+  }
+  memset(node, 0, sizeof(*node));
+  if(tree->tx) {
+    if(tree->nfresh == tree->afresh) {
+      tree->afresh = tree->afresh ? tree->afresh * 2 : 64;
+      tree->fresh = (btrie_collapsed_node<W> **)
+        realloc(tree->fresh, tree->afresh * sizeof(*tree->fresh));
+    }
+    tree->fresh[tree->nfresh++] = node;
+    node->fresh = 1;
+  }
+  return node;
+}
+template <int W>
+static void free_node(btrie_tree<W> *tree, btrie_collapsed_node<W> *node) {
 #ifdef DEBUG_BTRIE
   if(node->long_desc) free(node->long_desc);
 #endif
-  free(node);
-}
-void drop_tree(btrie *tree, void (*f)(void *)) {
-  drop_node(*tree, f);
-  *tree = NULL;
-}
-static inline int match_bpm(btrie_node *node,
-                            uint32_t *key, unsigned char match_len) {
-  register int i, m = (match_len-1)/32;
-  if(match_len <= 0) return 1;
-  for(i=0;i<=m;i++) {
-    if(i<m) { /* we're matching a whole word */
-      if(node->bits[i] != key[i]) return 0;
-    }
-    else {
-      uint32_t mask = ((match_len % 32) == 0) ? 0xffffffff :
-        ~(0xffffffff >> (match_len % 32));
-      if((node->bits[i] & mask) != (key[i] & mask)) return 0;
-    }
+  node->prefix_len = NODE_FREE;
+  node->data = NULL;
+  node->bit[1] = NULL;
+  node->bit[0] = tree->free_nodes;
+  tree->free_nodes = node;
+  tree->nfree++;
+}
+
+static void free_dir24(struct btrie_dir24 *);
+static void free_filter(struct btrie_filter *);
+
+/*
+ * Copy-on-write transactions.  Nodes allocated inside a transaction are
+ * fresh: no reader can have seen them, so they are changed in place.
+ * Any other node is copied before it is changed, and its parent with
+ * it, up to the root; the originals and the data of deleted routes wait
+ * in the retired list until the caller knows no reader holds them.
+ */
+struct btrie_retired {
+  void **nodes, **data;
+  size_t nnodes, anodes, ndata, adata;
+};
+
+static void retire_push(void ***v, size_t *n, size_t *a, void *p) {
+  if(*n == *a) {
+    *a = *a ? *a * 2 : 64;
+    *v = (void **)realloc(*v, *a * sizeof(**v));
   }
-  return 1;
+  (*v)[(*n)++] = p;
 }
 
-static inline int calc_bits_in_commons(btrie_node *node,
-                                       uint32_t *key,
-                                       unsigned char match_len) {
- /* Largest common mask */
-  int i;
-  uint32_t prefix_len = 0;
-  const unsigned int max_prefix_len = (match_len > node->prefix_len) ? match_len : node->prefix_len;
+template <int W>
+static void retire_data(btrie_tree<W> *tree, void *data) {
+  btrie_retired *r = tree->retired;
+  if(!r) r = tree->retired = (btrie_retired *)calloc(1, sizeof(*r));
+  retire_push(&r->data, &r->ndata, &r->adata, data);
+}
 
-  for (i = 0; i < MAXBITS/32; i++) {
-    uint32_t mask = 0, trymask;
+/* a route's data replaced: the old goes as a deleted route's would */
+template <int W>
+static void replace_data(btrie_tree<W> *tree, btrie_collapsed_node<W> *node,
+                         void *data, void (*f)(void *)) {
+  void *old = node->data;
+  node->data = data;
+  if(!old || old == data) return;
+  if(tree->tx) retire_data(tree, old);
+  else if(f) f(old);
+}
 
-    while(mask != 0xffffffff && prefix_len < max_prefix_len) {
-      trymask = (mask >> 1) | 0x80000000;
-      if((node->bits[i] & trymask) != (key[i] & trymask)) {
-        break;
-      }
-      mask = trymask;
-      prefix_len++;
+template <int W>
+static btrie_collapsed_node<W> *cow_node(btrie_tree<W> *tree,
+                                         btrie_collapsed_node<W> *node) {
+  btrie_collapsed_node<W> *copy = alloc_node(tree);
+  btrie_retired *r = tree->retired;
+  memcpy(copy, node, sizeof(*copy));
+  copy->fresh = 1;
+#ifdef DEBUG_BTRIE
+  if(node->long_desc) copy->long_desc = strdup(node->long_desc);
+#endif
+  if(!r) r = tree->retired = (btrie_retired *)calloc(1, sizeof(*r));
+  retire_push(&r->nodes, &r->nnodes, &r->anodes, node);
+  return copy;
+}
+
+/* make the path to the node of length len on key's path fresh; that
+ * node must exist */
+template <int W>
+static btrie_collapsed_node<W> *
+cow_path(btrie_tree<W> *tree, const typename btrie_key<W>::type &key,
+         unsigned char len) {
+  typedef btrie_collapsed_node<W> node_t;
+  node_t *node = tree->root, *child;
+  int b;
+  if(!node->fresh) tree->root = node = cow_node(tree, node);
+  while(node->prefix_len < len) {
+    b = btrie_key<W>::bit(key, node->prefix_len+1);
+    child = node->bit[b];
+    if(!child->fresh) node->bit[b] = child = cow_node(tree, child);
+    node = child;
+  }
+  return node;
+}
+
+template <int W>
+void tree_begin(btrie_tree<W> *tree) {
+  tree->tx = 1;
+}
+template <int W>
+btrie_retired *tree_commit(btrie_tree<W> *tree) {
+  btrie_retired *r = tree->retired;
+  size_t i;
+  for(i=0;i<tree->nfresh;i++) tree->fresh[i]->fresh = 0;
+  tree->nfresh = 0;
+  tree->tx = 0;
+  tree->retired = NULL;
+  return r;
+}
+template <int W>
+void tree_release(btrie_tree<W> *tree, btrie_retired *r, void (*f)(void *)) {
+  size_t i;
+  if(!r) return;
+  for(i=0;i<r->nnodes;i++) free_node(tree, (btrie_collapsed_node<W> *)r->nodes[i]);
+  for(i=0;f && i<r->ndata;i++) f(r->data[i]);
+  free(r->nodes);
+  free(r->data);
+  free(r);
+}
+
+template <int W>
+void init_tree(btrie_tree<W> *tree) {
+  memset(tree, 0, sizeof(*tree));
+}
+template <int W>
+void drop_tree(btrie_tree<W> *tree, void (*f)(void *)) {
+  typedef btrie_collapsed_node<W> node_t;
+  btrie_slab<W> *slab, *next;
+  uint32_t i;
+  tree_release(tree, tree->retired, f);
+  free(tree->fresh);
+  for(slab = tree->slabs; slab; slab = next) {
+    next = slab->next;
+    for(i=0; i<slab->used; i++) {
+      node_t *node = &slab->nodes[i];
+      if(node->prefix_len == NODE_FREE) continue;
+      if(node->data && f) f(node->data);
+#ifdef DEBUG_BTRIE
+      if(node->long_desc) free(node->long_desc);
+#endif
     }
+    free(slab);
+  }
+  free_dir24(tree->dir);
+  free_filter(tree->filter);
+  init_tree(tree);
+}
+template <int W>
+void tree_alloc_stats(btrie_tree<W> *tree, btrie_alloc_stats *st) {
+  st->slabs = tree->nslabs;
+  st->nodes_free = tree->nfree;
+  st->nodes_used = tree->nslabs ?
+    (tree->nslabs - 1) * SLAB_NODES + tree->slabs->used - tree->nfree : 0;
+  st->node_size = sizeof(btrie_collapsed_node<W>);
+  st->bytes = tree->nslabs * sizeof(btrie_slab<W>);
+}
+
+/*
+ * Prefilter.  The address space is cut into buckets, /20s for IPv4 and
+ * /32s for IPv6, and counts[slot] holds the number of routes reaching
+ * into the buckets landing in each slot: IPv4 buckets have a slot each,
+ * IPv6 buckets are hashed onto the same 1M slots.  (/16s would be
+ * smaller, but a blocklist of a few hundred thousand hosts touches
+ * nearly all of them.)  bits mirrors which counts are nonzero and is all
+ * a lookup reads.  A route shorter than a bucket is counted in every
+ * bucket it covers, up to FILTER_SPAN bits' worth; beyond that it is
+ * wide and, while there are any, the filter passes everything.  Only
+ * add_route, add_sorted and del_route change which routes exist, so only
+ * they call filter_add and filter_del.
+ */
+#define FILTER_BITS 20
+#define FILTER_SPAN 16
+
+struct btrie_filter {
+  uint32_t wide;
+  uint32_t *counts;
+  uint64_t bits[(1 << FILTER_BITS) / 64];
+};
+
+template <int W> struct filter_bucket;
+template <> struct filter_bucket<32> {
+  enum { len = FILTER_BITS };
+  static inline uint32_t slot(uint32_t b) { return b; }
+};
+template <> struct filter_bucket<128> {
+  enum { len = 32 };
+  static inline uint32_t slot(uint32_t b) { return (b * 0x9e3779b1) >> (32 - FILTER_BITS); }
+};
+
+template <int W>
+static inline int filter_pass(btrie_tree<W> *tree,
+                              const typename btrie_key<W>::type &key) {
+  struct btrie_filter *f = tree->filter;
+  uint32_t s;
+  if(!f || f->wide) return 1;
+  s = filter_bucket<W>::slot(btrie_key<W>::chunk(key, 0, filter_bucket<W>::len));
+  return (f->bits[s / 64] >> (s % 64)) & 1;
+}
 
-    if (mask != 0xffffffff || prefix_len >= max_prefix_len) {
+template <int W>
+static void filter_count(btrie_tree<W> *tree, const typename btrie_key<W>::type &key,
+                         unsigned char prefix_len, int delta) {
+  typedef filter_bucket<W> B;
+  struct btrie_filter *f = tree->filter;
+  uint32_t first, i, n, s;
+  if(!f) return;
+  if(prefix_len + FILTER_SPAN < B::len) {
+    f->wide += delta;
+    return;
+  }
+  first = btrie_key<W>::chunk(key, 0, B::len);
+  n = prefix_len < B::len ? 1u << (B::len - prefix_len) : 1;
+  for(i=0;i<n;i++) {
+    s = B::slot(first + i);
+    f->counts[s] += delta;
+    if(f->counts[s]) f->bits[s / 64] |= (uint64_t)1 << (s % 64);
+    else f->bits[s / 64] &= ~((uint64_t)1 << (s % 64));
+  }
+}
+template <int W>
+static inline void filter_add(btrie_tree<W> *tree, const typename btrie_key<W>::type &key,
+                              unsigned char prefix_len) {
+  filter_count<W>(tree, key, prefix_len, 1);
+}
+template <int W>
+static inline void filter_del(btrie_tree<W> *tree, const typename btrie_key<W>::type &key,
+                              unsigned char prefix_len) {
+  filter_count<W>(tree, key, prefix_len, -1);
+}
+
+template <int W>
+void enable_prefilter(btrie_tree<W> *tree) {
+  btrie_collapsed_node<W> *stack[W+2], *node;
+  int sp = 0;
+  if(tree->filter) return;
+  tree->filter = (struct btrie_filter *)calloc(1, sizeof(*tree->filter));
+  tree->filter->counts = (uint32_t *)calloc(1 << FILTER_BITS, sizeof(uint32_t));
+  if(tree->root) stack[sp++] = tree->root;
+  while(sp > 0) {
+    node = stack[--sp];
+    if(node->bit[0]) stack[sp++] = node->bit[0];
+    if(node->bit[1]) stack[sp++] = node->bit[1];
+    if(!node->incidental) filter_add<W>(tree, node->key, node->prefix_len);
+  }
+}
+static void free_filter(struct btrie_filter *f) {
+  if(!f) return;
+  free(f->counts);
+  free(f);
+}
+template <int W>
+void disable_prefilter(btrie_tree<W> *tree) {
+  free_filter(tree->filter);
+  tree->filter = NULL;
+}
+int prefilter_ipv4_key(btrie4 *tree, uint32_t ia) {
+  return filter_pass<32>(tree, ia);
+}
+int prefilter_ipv6_key(btrie6 *tree, const uint32_t *words) {
+  return filter_pass<128>(tree, btrie_key<128>::from_words(words));
+}
+
+template <int W>
+static inline int calc_bits_in_commons(btrie_collapsed_node<W> *node,
+                                       const typename btrie_key<W>::type &key,
+                                       unsigned char match_len) {
+ /* Largest common mask */
+  const int max_prefix_len = (match_len > node->prefix_len) ? match_len : node->prefix_len;
+  int prefix_len = btrie_key<W>::common(node->key, key);
+  return (prefix_len < max_prefix_len) ? prefix_len : max_prefix_len;
+}
+
+template <int W>
+static int
+find_bpm_route(btrie_tree<W> *tree, const typename btrie_key<W>::type &key,
+               unsigned char prefix_len, btrie_collapsed_node<W> **rnode,
+               btrie_collapsed_node<W> **explicit_container) {
+  typedef btrie_key<W> K;
+  typedef btrie_collapsed_node<W> node_t;
+  int exact = 0;
+  node_t *first = NULL, *last = NULL, *parent = NULL, *node;
+  node = tree->root;
+  while(node && node->prefix_len <= prefix_len &&
+        match_bpm<W>(node, key, node->prefix_len)) {
+#ifdef DEBUG_BTRIE
+    char ipb[128];
+    describe<W>(key, ipb, sizeof(ipb));
+    fprintf(stderr, "%s looking at %s/%d\n", ipb, node->long_desc, node->prefix_len);
+#endif
+    parent = node;
+    if(!first) first = node;
+    if(!node->incidental) last = node;
+    if(parent->prefix_len == prefix_len) {
+      exact = 1;
       break;
     }
+    node = parent->bit[K::bit(key, parent->prefix_len+1)];
   }
-  return prefix_len;
+  if(rnode) *rnode = parent;
+  if(explicit_container)
+    *explicit_container = last ? last : first;
+  return exact;
 }
 
+template <int W>
 static int
-del_route(btrie *tree, uint32_t *key, unsigned char prefix_len,
-          void (*f)(void *)) {
-  btrie_node *parent = NULL, *node;
-  node = *tree;
+del_route(btrie_tree<W> *tree, const typename btrie_key<W>::type &key,
+          unsigned char prefix_len, void (*f)(void *)) {
+  typedef btrie_key<W> K;
+  typedef btrie_collapsed_node<W> node_t;
+  node_t *gparent = NULL, *parent = NULL, *node;
+  if(tree->tx) {
+    if(!find_bpm_route<W>(tree, key, prefix_len, &node, NULL) ||
+       node->incidental) return 0;
+    cow_path<W>(tree, key, prefix_len);
+  }
+  node = tree->root;
   while(node && node->prefix_len <= prefix_len &&
-        match_bpm(node, key, node->prefix_len)) {
+        match_bpm<W>(node, key, node->prefix_len)) {
     if(node->prefix_len == prefix_len) {
-      /* exact match */
-      if(node->data && f) f(node->data);
+      /* exact match, but only a route if it isn't a mere branch point */
+      if(node->incidental) return 0;
+      tree->generation++;
+      filter_del<W>(tree, key, prefix_len);
+      if(node->data) {
+        /* readers of the old root may still return it */
+        if(tree->tx) retire_data(tree, node->data);
+        else if(f) f(node->data);
+      }
       node->data = NULL;
       node->incidental = 1;
       if(node->bit[0] == NULL || node->bit[1] == NULL) {
         /* collapse (even if both are null) */
+        node_t *child = node->bit[ (node->bit[0] == NULL) ? 1 : 0 ];
         if (parent)
-          parent->bit[BIT_AT(key, parent->prefix_len+1)] =
-            node->bit[ (node->bit[0] == NULL) ? 1 : 0 ];
-        node->bit[0] = node->bit[1] = NULL;
-        drop_node(node, f);
-        if (node == *tree)
-          *tree = NULL;
+          parent->bit[K::bit(key, parent->prefix_len+1)] = child;
+        else
+          tree->root = child;
+        free_node(tree, node);
+        /* a branch point left with a single child is no longer needed */
+        if(parent && parent->incidental &&
+           (parent->bit[0] == NULL || parent->bit[1] == NULL)) {
+          child = parent->bit[ (parent->bit[0] == NULL) ? 1 : 0 ];
+          if (gparent)
+            gparent->bit[K::bit(key, gparent->prefix_len+1)] = child;
+          else
+            tree->root = child;
+          free_node(tree, parent);
+        }
       }
       return 1;
     }
+    gparent = parent;
     parent = node;
-    node = parent->bit[BIT_AT(key, parent->prefix_len+1)];
+    node = parent->bit[K::bit(key, parent->prefix_len+1)];
   }
   return 0;
 }
-static int
-find_bpm_route(btrie *tree, uint32_t *key, unsigned char prefix_len,
-               btrie_node **rnode, btrie_node **explicit_container) {
-  int stack_pos = -1, exact = 0;
-  btrie_node *pstack[MAXBITS], *parent = NULL, *node;
-  node = *tree;
-  while(node && node->prefix_len <= prefix_len &&
-        match_bpm(node, key, node->prefix_len)) {
-#ifdef DEBUG_BTRIE
-    char ipb[128];
-    uint32_t addr[4];
-    int i=0; \
-    for(i=0;i<4;i++) addr[i] = (i*32)+1 >= prefix_len ? 0 : htonl(key[i]);
-    inet_ntop(prefix_len > 32 ? AF_INET6 : AF_INET, addr, ipb, sizeof(ipb));
-    fprintf(stderr, "%s looking at %s/%d\n", ipb, node->long_desc, node->prefix_len);
-#endif
-    parent = pstack[++stack_pos] = node;
-    if(parent->prefix_len == prefix_len) {
-      exact = 1;
-      break;
+
+/*
+ * DIR-24-8 direct index for IPv4.
+ *
+ * tbl24 has one entry per /24; an entry either resolves the whole /24
+ * or (DIR_EXT) names a 256 entry group in tbl8 resolving each /32.
+ * Resolved entries carry the prefix length of the route that wrote them
+ * so that a route only overwrites entries written by routes no longer
+ * than itself, and a delete only touches entries the deleted route
+ * wrote.  Entries refer to routes through a reference counted hop table
+ * so a 32 bit entry is enough; hop 0 is "no route".
+ */
+#define DIR_EXT       0x80000000
+#define DIR_LEN_SHIFT 25
+#define DIR_IDX_MASK  0x01ffffff
+#define DIR_ENTRY(idx, len) ((idx) ? (((uint32_t)(len) << DIR_LEN_SHIFT) | (idx)) : 0)
+#define DIR_LEN(e)    (((e) >> DIR_LEN_SHIFT) & 0x3f)
+#define DIR_IDX(e)    ((e) & DIR_IDX_MASK)
+
+typedef struct {
+  void *data;
+  uint32_t refcnt;
+} dir_hop;
+
+struct btrie_dir24 {
+  uint32_t *tbl24;
+  uint32_t *tbl8;
+  uint32_t ngroups, agroups, free_group;
+  dir_hop *hops;
+  uint32_t nhops, ahops, free_hop;
+};
+
+static uint32_t dir_hop_alloc(struct btrie_dir24 *d, void *data) {
+  uint32_t idx;
+  if(!data) return 0;
+  if(d->free_hop) {
+    idx = d->free_hop;
+    d->free_hop = (uint32_t)(uintptr_t)d->hops[idx].data;
+  }
+  else {
+    if(d->nhops >= d->ahops) {
+      d->ahops = d->ahops ? d->ahops*2 : 1024;
+      d->hops = (dir_hop *)realloc(d->hops, d->ahops * sizeof(*d->hops));
     }
-    node = parent->bit[BIT_AT(key, parent->prefix_len+1)];
+    idx = d->nhops++;
+    assert(idx <= DIR_IDX_MASK);
   }
-  if(rnode) *rnode = parent;
-  while(stack_pos > 0 && pstack[stack_pos]->incidental == 1) stack_pos--;
-  if(explicit_container)
-    *explicit_container = stack_pos >= 0 ? pstack[stack_pos] : NULL;
-  return exact;
+  d->hops[idx].data = data;
+  d->hops[idx].refcnt = 0;
+  return idx;
 }
-void *
-find_bpm_route_ipv6(btrie *tree, struct in6_addr *a, unsigned char *pl) {
-  btrie_node *node = NULL;
-  uint32_t ia[4], i;
-  memcpy(ia, &a->s6_addr, sizeof(ia));
+static void dir_hop_release(struct btrie_dir24 *d, uint32_t idx) {
+  if(!idx || --d->hops[idx].refcnt > 0) return;
+  d->hops[idx].data = (void *)(uintptr_t)d->free_hop;
+  d->free_hop = idx;
+}
+static inline void dir_put(struct btrie_dir24 *d, uint32_t *e, uint32_t ne) {
+  if(DIR_IDX(ne)) d->hops[DIR_IDX(ne)].refcnt++;
+  dir_hop_release(d, DIR_IDX(*e));
+  *e = ne;
+}
+static uint32_t dir_group_alloc(struct btrie_dir24 *d, uint32_t fill) {
+  uint32_t g, i;
+  if(d->free_group != (uint32_t)-1) {
+    g = d->free_group;
+    d->free_group = d->tbl8[g*256];
+  }
+  else {
+    if(d->ngroups == d->agroups) {
+      d->agroups = d->agroups ? d->agroups*2 : 64;
+      d->tbl8 = (uint32_t *)realloc(d->tbl8, d->agroups * 256 * sizeof(*d->tbl8));
+    }
+    g = d->ngroups++;
+  }
+  for(i=0;i<256;i++) {
+    d->tbl8[g*256 + i] = fill;
+    if(DIR_IDX(fill)) d->hops[DIR_IDX(fill)].refcnt++;
+  }
+  return g;
+}
+/* fold a group back into its tbl24 entry once it no longer splits the /24 */
+static void dir_group_collapse(struct btrie_dir24 *d, uint32_t *e) {
+  uint32_t g = *e & ~DIR_EXT, *grp = d->tbl8 + g*256, i;
+  for(i=1;i<256;i++) if(grp[i] != grp[0]) return;
+  *e = 0;
+  dir_put(d, e, grp[0]);
+  for(i=0;i<256;i++) dir_put(d, &grp[i], 0);
+  grp[0] = d->free_group;
+  d->free_group = g;
+}
+
+static void
+dir_update(struct btrie_dir24 *d, uint32_t ia, unsigned char prefix_len,
+           int deleting, uint32_t ne) {
+  uint32_t i, j, start, count, *grp;
+  if(prefix_len <= 24) {
+    start = ia >> 8;
+    count = 1u << (24 - prefix_len);
+    for(i=start;i<start+count;i++) {
+      uint32_t *e = &d->tbl24[i];
+      if(*e & DIR_EXT) {
+        grp = d->tbl8 + (*e & ~DIR_EXT)*256;
+        for(j=0;j<256;j++) {
+          if(deleting ? (DIR_IDX(grp[j]) && DIR_LEN(grp[j]) == prefix_len)
+                      : (DIR_LEN(grp[j]) <= prefix_len))
+            dir_put(d, &grp[j], ne);
+        }
+        if(deleting) dir_group_collapse(d, e);
+      }
+      else if(deleting ? (DIR_IDX(*e) && DIR_LEN(*e) == prefix_len)
+                       : (DIR_LEN(*e) <= prefix_len)) {
+        dir_put(d, e, ne);
+      }
+    }
+    return;
+  }
+  uint32_t *e = &d->tbl24[ia >> 8];
+  if(!(*e & DIR_EXT)) {
+    if(deleting) return;
+    uint32_t g = dir_group_alloc(d, *e);
+    dir_put(d, e, 0);
+    *e = DIR_EXT | g;
+  }
+  grp = d->tbl8 + (*e & ~DIR_EXT)*256;
+  start = ia & 0xff;
+  count = 1u << (32 - prefix_len);
+  for(j=start;j<start+count;j++) {
+    if(deleting ? (DIR_IDX(grp[j]) && DIR_LEN(grp[j]) == prefix_len)
+                : (DIR_LEN(grp[j]) <= prefix_len))
+      dir_put(d, &grp[j], ne);
+  }
+  if(deleting) dir_group_collapse(d, e);
+}
+static void
+dir_add(struct btrie_dir24 *d, uint32_t ia, unsigned char prefix_len,
+        void *data) {
+  uint32_t idx = dir_hop_alloc(d, data);
+  if(!idx) return;
+  d->hops[idx].refcnt++; /* hold it while writing */
+  dir_update(d, ia, prefix_len, 0, DIR_ENTRY(idx, prefix_len));
+  dir_hop_release(d, idx);
+}
+static void
+dir_del(btrie4 *tree, uint32_t ia, unsigned char prefix_len) {
+  struct btrie_dir24 *d = tree->dir;
+  btrie_collapsed_node<32> *cover = NULL;
+  uint32_t idx;
+  find_bpm_route<32>(tree, ia, prefix_len, NULL, &cover);
+  idx = (cover && cover->data) ? dir_hop_alloc(d, cover->data) : 0;
+  if(idx) d->hops[idx].refcnt++;
+  dir_update(d, ia, prefix_len, 1,
+             DIR_ENTRY(idx, idx ? cover->prefix_len : 0));
+  dir_hop_release(d, idx);
+}
+
+void enable_dir24(btrie4 *tree) {
+  struct btrie_dir24 *d;
+  btrie_collapsed_node<32> *stack[32+2], *node;
+  int sp = 0;
+  if(tree->dir) return;
+  d = (struct btrie_dir24 *)calloc(1, sizeof(*d));
+  d->tbl24 = (uint32_t *)calloc(1 << 24, sizeof(*d->tbl24));
+  d->free_group = (uint32_t)-1;
+  d->nhops = 1;
+  tree->dir = d;
+  if(tree->root) stack[sp++] = tree->root;
+  while(sp > 0) {
+    node = stack[--sp];
+    if(node->bit[0]) stack[sp++] = node->bit[0];
+    if(node->bit[1]) stack[sp++] = node->bit[1];
+    if(!node->incidental && node->data)
+      dir_add(d, node->key, node->prefix_len, node->data);
+  }
+}
+static void free_dir24(struct btrie_dir24 *d) {
+  if(!d) return;
+  free(d->tbl24);
+  free(d->tbl8);
+  free(d->hops);
+  free(d);
+}
+void disable_dir24(btrie4 *tree) {
+  free_dir24(tree->dir);
+  tree->dir = NULL;
+}
+
+static inline void ipv6_words(struct in6_addr *a, uint32_t *ia) {
+  int i;
+  memcpy(ia, &a->s6_addr, 16);
   for(i=0;i<4;i++) ia[i] = ntohl(ia[i]);
-  find_bpm_route(tree, ia, 128, NULL, &node);
+}
+
+void *
+find_bpm_route_ipv6_key(btrie6 *tree, const uint32_t *words, unsigned char *pl) {
+  btrie_collapsed_node<128> *node = NULL;
+  btrie_key<128>::type key = btrie_key<128>::from_words(words);
+  if(!filter_pass<128>(tree, key)) return NULL;
+  find_bpm_route<128>(tree, key, 128, NULL, &node);
   if(node && pl) *pl = node->prefix_len;
   if(node && node->data) return node->data;
   return NULL;
 }
 void *
-find_bpm_route_ipv4(btrie *tree, struct in_addr *a, unsigned char *pl) {
-  btrie_node *node = NULL;
-  uint32_t ia = ntohl(a->s_addr);
-  find_bpm_route(tree, &ia, 32, NULL, &node);
+find_bpm_route_ipv6(btrie6 *tree, struct in6_addr *a, unsigned char *pl) {
+  uint32_t ia[4];
+  ipv6_words(a, ia);
+  return find_bpm_route_ipv6_key(tree, ia, pl);
+}
+void *
+find_bpm_route_ipv4_key(btrie4 *tree, uint32_t ia, unsigned char *pl) {
+  btrie_collapsed_node<32> *node = NULL;
+  if(!filter_pass<32>(tree, ia)) return NULL;
+  if(tree->dir) {
+    uint32_t e = tree->dir->tbl24[ia >> 8];
+    if(e & DIR_EXT) e = tree->dir->tbl8[(e & ~DIR_EXT)*256 + (ia & 0xff)];
+    if(!DIR_IDX(e)) return NULL;
+    if(pl) *pl = DIR_LEN(e);
+    return tree->dir->hops[DIR_IDX(e)].data;
+  }
+  find_bpm_route<32>(tree, ia, 32, NULL, &node);
   if(node && pl) *pl = node->prefix_len;
   if(node && node->data) return node->data;
   return NULL;
 }
+void *
+find_bpm_route_ipv4(btrie4 *tree, struct in_addr *a, unsigned char *pl) {
+  return find_bpm_route_ipv4_key(tree, ntohl(a->s_addr), pl);
+}
+
+/*
+ * Batched lookups.  BPM_LANES keys are walked at once, one hop per key
+ * per round, and each key's next node is prefetched before moving on to
+ * the other lanes so that the cache misses of the different walks
+ * overlap instead of queueing up behind each other.  Results are the
+ * same as calling find_bpm_route for each key in turn.
+ */
+#define BPM_LANES 8
+
+/* the index of the first key from next on the prefilter passes; the
+ * keys skipped get no route */
+template <int W>
+static inline int filter_skip(btrie_tree<W> *tree, const uint32_t *keys,
+                              int next, int n, void **out) {
+  if(!tree->filter) return next;
+  while(next < n && !filter_pass<W>(tree, btrie_key<W>::from_words(keys + next*(W/32))))
+    out[next++] = NULL;
+  return next;
+}
+
+template <int W>
+static void
+find_bpm_route_many(btrie_tree<W> *tree, const uint32_t *keys, int n,
+                    void **out) {
+  typedef btrie_key<W> K;
+  typedef typename btrie_key<W>::type bkey_t;
+  typedef btrie_collapsed_node<W> node_t;
+  node_t *node[BPM_LANES], *best[BPM_LANES], *nd;
+  bkey_t key[BPM_LANES];
+  int slot[BPM_LANES], lane, next = 0, active = 0;
 
+  if(tree->root) __builtin_prefetch(tree->root);
+  for(lane=0; lane<BPM_LANES; lane++) {
+    slot[lane] = -1;
+    next = filter_skip<W>(tree, keys, next, n, out);
+    if(next >= n) continue;
+    slot[lane] = next;
+    key[lane] = K::from_words(keys + next*(W/32));
+    node[lane] = tree->root;
+    best[lane] = NULL;
+    next++;
+    active++;
+  }
+  while(active) {
+    for(lane=0; lane<BPM_LANES; lane++) {
+      if(slot[lane] < 0) continue;
+      nd = node[lane];
+      if(nd && match_bpm<W>(nd, key[lane], nd->prefix_len)) {
+        if(!nd->incidental) best[lane] = nd;
+        nd = (nd->prefix_len == W) ? NULL :
+          nd->bit[K::bit(key[lane], nd->prefix_len+1)];
+        if(nd) __builtin_prefetch(nd);
+        node[lane] = nd;
+        continue;
+      }
+      out[slot[lane]] = best[lane] ? best[lane]->data : NULL;
+      next = filter_skip<W>(tree, keys, next, n, out);
+      if(next < n) {
+        slot[lane] = next;
+        key[lane] = K::from_words(keys + next*(W/32));
+        node[lane] = tree->root;
+        best[lane] = NULL;
+        next++;
+      }
+      else {
+        slot[lane] = -1;
+        active--;
+      }
+    }
+  }
+}
+void
+find_bpm_route_ipv4_many(btrie4 *tree, const uint32_t *keys, int n,
+                         void **out) {
+  int i;
+  if(tree->dir) {
+    struct btrie_dir24 *d = tree->dir;
+    for(i=0;i<n && i<BPM_LANES;i++) __builtin_prefetch(&d->tbl24[keys[i] >> 8]);
+    for(i=0;i<n;i++) {
+      uint32_t e;
+      if(i + BPM_LANES < n)
+        __builtin_prefetch(&d->tbl24[keys[i + BPM_LANES] >> 8]);
+      if(!filter_pass<32>(tree, keys[i])) {
+        out[i] = NULL;
+        continue;
+      }
+      e = d->tbl24[keys[i] >> 8];
+      if(e & DIR_EXT) e = d->tbl8[(e & ~DIR_EXT)*256 + (keys[i] & 0xff)];
+      out[i] = DIR_IDX(e) ? d->hops[DIR_IDX(e)].data : NULL;
+    }
+    return;
+  }
+  find_bpm_route_many<32>(tree, keys, n, out);
+}
+void
+find_bpm_route_ipv6_many(btrie6 *tree, const uint32_t *keys, int n,
+                         void **out) {
+  find_bpm_route_many<128>(tree, keys, n, out);
+}
+
+int
+del_route_ipv6_key(btrie6 *tree, const uint32_t *words,
+                   unsigned char prefix_len, void (*f)(void *)) {
+  return del_route<128>(tree, btrie_key<128>::from_words(words), prefix_len, f);
+}
 int
-del_route_ipv6(btrie *tree, struct in6_addr *a, unsigned char prefix_len,
+del_route_ipv6(btrie6 *tree, struct in6_addr *a, unsigned char prefix_len,
                void (*f)(void *)) {
-  uint32_t ia[4], i;
-  memcpy(ia, &a->s6_addr, sizeof(ia));
-  for(i=0;i<4;i++) ia[i] = ntohl(ia[i]);
-  return del_route(tree, ia, prefix_len, f);
+  uint32_t ia[4];
+  ipv6_words(a, ia);
+  return del_route_ipv6_key(tree, ia, prefix_len, f);
+}
+int
+del_route_ipv4_key(btrie4 *tree, uint32_t ia, unsigned char prefix_len,
+                   void (*f)(void *)) {
+  ia = btrie_key<32>::mask(ia, prefix_len);
+  if(!del_route<32>(tree, ia, prefix_len, f)) return 0;
+  if(tree->dir) dir_del(tree, ia, prefix_len);
+  return 1;
 }
 int
-del_route_ipv4(btrie *tree, struct in_addr *a, unsigned char prefix_len,
+del_route_ipv4(btrie4 *tree, struct in_addr *a, unsigned char prefix_len,
                void (*f)(void *)) {
-  uint32_t ia = ntohl(a->s_addr);
-  return del_route(tree, &ia, prefix_len, f);
+  return del_route_ipv4_key(tree, ntohl(a->s_addr), prefix_len, f);
 }
 
-void add_route(btrie *tree, uint32_t *key, unsigned char prefix_len,
-               void *data) {
+/* key must already be masked to prefix_len */
+template <int W>
+static void add_route(btrie_tree<W> *tree,
+                      const typename btrie_key<W>::type &key,
+                      unsigned char prefix_len, void *data,
+                      void (*f)(void *)) {
+  typedef btrie_key<W> K;
+  typedef btrie_collapsed_node<W> node_t;
 #ifdef DEBUG_BTRIE
   char ipb[128];
 #define DA(n, pl, m) do { \
-  uint32_t addr[4]; \
-  int i=0; \
-  for(i=0;i<4;i++) addr[i] = (i*32)+1 >= prefix_len ? 0 : htonl(key[i]); \
-  inet_ntop(prefix_len > 32 ? AF_INET6 : AF_INET, addr, ipb, sizeof(ipb)); \
+  describe<W>((n)->key, ipb, sizeof(ipb)); \
   (n)->long_desc = strdup(ipb); \
   fprintf(stderr, "LINE[%d] N(%s/%d) -> %s\n", __LINE__, (n)->long_desc, pl, m ? m : "insert"); \
 } while(0)
 #else
 #define DA(n, pl, m)
 #endif
-  btrie_node *node, *parent, *down, *newnode;
+  node_t *node, *parent, *down, *newnode;
   int bits_in_common;
 
-  assert(prefix_len <= MAXBITS);
-  if(!*tree) {
-    node = (btrie_node *)calloc(1, sizeof(*node));
+  assert(prefix_len <= W);
+  tree->generation++;
+  if(!tree->root) {
+    node = alloc_node(tree);
     node->data = data;
-    memcpy((void *)node->bits, (void *)key, 4*((prefix_len+31)/32));
+    node->key = key;
     node->prefix_len = prefix_len;
     DA(node, prefix_len, NULL);
-    *tree = node;
+    tree->root = node;
+    filter_add<W>(tree, key, prefix_len);
     return;
   }
-  if(find_bpm_route(tree, key, prefix_len, &node, NULL)) {
+  if(find_bpm_route<W>(tree, key, prefix_len, &node, NULL)) {
     /* exact match */
+    if(tree->tx) node = cow_path<W>(tree, key, node->prefix_len);
+    if(node->incidental) filter_add<W>(tree, key, prefix_len);
     node->incidental = 0;
-    node->data = data;
+    replace_data<W>(tree, node, data, f);
     return;
   }
 
-  newnode = (btrie_node *)calloc(1, sizeof(*node));
+  newnode = alloc_node(tree);
   newnode->data = data;
-  memcpy((void *)newnode->bits, (void *)key, 4*((prefix_len+31)/32));
+  newnode->key = key;
   newnode->prefix_len = prefix_len;
+  filter_add<W>(tree, key, prefix_len);
 
-  if(!node) down = *tree;
-  else down = node->bit[BIT_AT(key, node->prefix_len+1)];
+  if(node && tree->tx) node = cow_path<W>(tree, key, node->prefix_len);
+  if(!node) down = tree->root;
+  else down = node->bit[K::bit(key, node->prefix_len+1)];
   if(!down) {
-    node->bit[BIT_AT(key, node->prefix_len+1)] = newnode;
+    node->bit[K::bit(key, node->prefix_len+1)] = newnode;
     DA(newnode, prefix_len, NULL);
     return;
   }
   /* here we must be inserting between node and down */
-  bits_in_common = calc_bits_in_commons(down, key, prefix_len);
+  bits_in_common = calc_bits_in_commons<W>(down, key, prefix_len);
   parent = node;
   DA(newnode, prefix_len, NULL);
   if(bits_in_common > prefix_len) bits_in_common = prefix_len;
@@ -267,50 +864,795 @@ void add_route(btrie *tree, uint32_t *key, unsigned char prefix_len,
     /* newnode can be the branch */
     int plen = parent ? parent->prefix_len+1 : 1;
     if(parent)
-      assert(BIT_AT(newnode->bits, plen) == BIT_AT(down->bits, plen));
-    newnode->bit[BIT_AT(down->bits, newnode->prefix_len+1)] = down;
-    if(!parent) *tree = newnode;
-    else parent->bit[BIT_AT(newnode->bits, plen)] = newnode;
+      assert(K::bit(newnode->key, plen) == K::bit(down->key, plen));
+    newnode->bit[K::bit(down->key, newnode->prefix_len+1)] = down;
+    if(!parent) tree->root = newnode;
+    else parent->bit[K::bit(newnode->key, plen)] = newnode;
     DA(newnode, prefix_len, NULL);
   }
   else {
     /* reparent */
-    node = (btrie_node *)calloc(1, sizeof(*node));
+    node = alloc_node(tree);
     node->prefix_len = bits_in_common;
     node->incidental = 1;
-    memcpy(node->bits, newnode->bits, sizeof(node->bits));
+    node->key = K::mask(newnode->key, bits_in_common);
     DA(node, node->prefix_len, "incidental");
-    assert(BIT_AT(down->bits, node->prefix_len+1) !=
-           BIT_AT(newnode->bits, node->prefix_len+1));
-    node->bit[BIT_AT(down->bits, node->prefix_len+1)] = down;
-    node->bit[BIT_AT(newnode->bits, node->prefix_len+1)] = newnode;
-    if(!parent) *tree = node;
-    else parent->bit[BIT_AT(node->bits, parent->prefix_len+1)] = node;
+    assert(K::bit(down->key, node->prefix_len+1) !=
+           K::bit(newnode->key, node->prefix_len+1));
+    node->bit[K::bit(down->key, node->prefix_len+1)] = down;
+    node->bit[K::bit(newnode->key, node->prefix_len+1)] = newnode;
+    if(!parent) tree->root = node;
+    else parent->bit[K::bit(node->key, parent->prefix_len+1)] = node;
     DA(newnode, prefix_len, NULL);
   }
 }
 
-void add_route_ipv4(btrie *tree, struct in_addr *a,
-                    unsigned char prefix_len, void *data) {
-  uint32_t ia = ntohl(a->s_addr), mask;
+void add_route_ipv4_key(btrie4 *tree, uint32_t ia, unsigned char prefix_len,
+                        void *data, void (*f)(void *)) {
   assert(prefix_len <= 32);
-  mask = (prefix_len == 32) ? 0xffffffff : ~(0xffffffff >> prefix_len);
-  ia &= mask;
-  add_route(tree, &ia, prefix_len, data);
-}
-void add_route_ipv6(btrie *tree, struct in6_addr *a,
-                    unsigned char prefix_len, void *data) {
-  uint32_t ia[4], i, mask;
-  int splen;
-  memcpy(ia, &a->s6_addr, sizeof(ia));
-  for(i=0;i<4;i++) {
-    splen = prefix_len - i*32;
-    mask = 0;
-    if(splen >= 0)
-      mask = (splen >= 32) ? 0xffffffff : ~(0xffffffff >> splen);
-    ia[i] = ntohl(ia[i]) & mask;
-  }
+  ia = btrie_key<32>::mask(ia, prefix_len);
+  add_route<32>(tree, ia, prefix_len, data, f);
+  if(tree->dir) dir_add(tree->dir, ia, prefix_len, data);
+}
+void add_route_ipv4(btrie4 *tree, struct in_addr *a, unsigned char prefix_len,
+                    void *data, void (*f)(void *)) {
+  add_route_ipv4_key(tree, ntohl(a->s_addr), prefix_len, data, f);
+}
+void add_route_ipv6_key(btrie6 *tree, const uint32_t *words,
+                        unsigned char prefix_len, void *data, void (*f)(void *)) {
   assert(prefix_len <= 128);
-  add_route(tree, ia, prefix_len, data);
+  add_route<128>(tree, btrie_key<128>::mask(btrie_key<128>::from_words(words),
+                                            prefix_len), prefix_len, data, f);
+}
+void add_route_ipv6(btrie6 *tree, struct in6_addr *a, unsigned char prefix_len,
+                    void *data, void (*f)(void *)) {
+  uint32_t ia[4];
+  ipv6_words(a, ia);
+  add_route_ipv6_key(tree, ia, prefix_len, data, f);
+}
+
+
+/*
+ * Enumeration.  find_all collects every route covering a key, shortest
+ * first, in the one walk find_bpm_route makes.  walk visits every route
+ * under a prefix in address order (a route before the longer ones it
+ * covers) with an explicit stack rather than recursion; the callback
+ * stops the walk by returning nonzero, which walk passes back.
+ */
+template <int W>
+static int find_all(btrie_tree<W> *tree, const typename btrie_key<W>::type &key,
+                    void **out, unsigned char *lens) {
+  typedef btrie_key<W> K;
+  btrie_collapsed_node<W> *node = tree->root;
+  int n = 0;
+  while(node && match_bpm<W>(node, key, node->prefix_len)) {
+    if(!node->incidental) {
+      out[n] = node->data;
+      lens[n++] = node->prefix_len;
+    }
+    if(node->prefix_len == W) break;
+    node = node->bit[K::bit(key, node->prefix_len+1)];
+  }
+  return n;
+}
+
+template <int W>
+static int walk(btrie_tree<W> *tree, const typename btrie_key<W>::type &key,
+                unsigned char prefix_len, btrie_walk_f f, void *ctx) {
+  typedef btrie_key<W> K;
+  btrie_collapsed_node<W> *stack[W+2], *node = tree->root;
+  uint32_t words[4];
+  int sp = 0, rv;
+
+  /* down to the first node inside the prefix */
+  while(node && node->prefix_len < prefix_len) {
+    if(!match_bpm<W>(node, key, node->prefix_len)) return 0;
+    node = node->bit[K::bit(key, node->prefix_len+1)];
+  }
+  if(!node || K::common(node->key, key) < prefix_len) return 0;
+
+  stack[sp++] = node;
+  while(sp > 0) {
+    node = stack[--sp];
+    if(!node->incidental) {
+      K::to_words(node->key, words);
+      if((rv = f(ctx, words, node->prefix_len, node->data)) != 0) return rv;
+    }
+    if(node->bit[1]) stack[sp++] = node->bit[1];
+    if(node->bit[0]) stack[sp++] = node->bit[0];
+  }
+  return 0;
+}
+
+int find_all_ipv4_key(btrie4 *tree, uint32_t ia, void **out,
+                      unsigned char *lens) {
+  return find_all<32>(tree, ia, out, lens);
+}
+int find_all_ipv6_key(btrie6 *tree, const uint32_t *words, void **out,
+                      unsigned char *lens) {
+  return find_all<128>(tree, btrie_key<128>::from_words(words), out, lens);
+}
+int walk_ipv4_key(btrie4 *tree, uint32_t ia, unsigned char prefix_len,
+                  btrie_walk_f f, void *ctx) {
+  return walk<32>(tree, btrie_key<32>::mask(ia, prefix_len), prefix_len, f, ctx);
+}
+int walk_ipv6_key(btrie6 *tree, const uint32_t *words, unsigned char prefix_len,
+                  btrie_walk_f f, void *ctx) {
+  typedef btrie_key<128> K;
+  return walk<128>(tree, K::mask(K::from_words(words), prefix_len), prefix_len, f, ctx);
+}
+
+/*
+ * Shape.  One pass over every node, keeping each node's depth (the root
+ * is at 0) on the stack beside it; a lookup that ends at a route has
+ * visited depth + 1 nodes on the way.
+ */
+template <int W>
+void tree_shape_stats(btrie_tree<W> *tree, btrie_shape_stats *st) {
+  btrie_collapsed_node<W> *stack[W+2], *node;
+  unsigned char depths[W+2];
+  size_t path = 0;
+  int sp = 0, depth;
+
+  memset(st, 0, sizeof(*st));
+  if(tree->root) {
+    stack[sp] = tree->root;
+    depths[sp++] = 0;
+  }
+  while(sp > 0) {
+    node = stack[--sp];
+    depth = depths[sp];
+    st->nodes++;
+    st->depth[depth]++;
+    if(depth > st->max_depth) st->max_depth = depth;
+    if(node->incidental) st->incidental++;
+    else {
+      st->routes++;
+      path += depth + 1;
+    }
+    if(node->bit[1]) {
+      stack[sp] = node->bit[1];
+      depths[sp++] = depth + 1;
+    }
+    if(node->bit[0]) {
+      stack[sp] = node->bit[0];
+      depths[sp++] = depth + 1;
+    }
+  }
+  st->avg_path = st->routes ? (double)path / st->routes : 0;
+  if(tree->dir)
+    st->dir_bytes = (1 << 24) * sizeof(*tree->dir->tbl24) +
+      tree->dir->agroups * 256 * sizeof(*tree->dir->tbl8) +
+      tree->dir->ahops * sizeof(*tree->dir->hops);
+  if(tree->filter)
+    st->dir_bytes += sizeof(*tree->filter) + (1 << FILTER_BITS) * sizeof(uint32_t);
+}
+
+/*
+ * Minimization.  Two rewrites, neither of which changes the route any
+ * address matches.  Sibling routes with the same value become a route
+ * for their parent, whose own value (if it had one) no address could
+ * reach; going up from the longest prefixes lets the merges cascade.
+ * Then a route whose value repeats that of the nearest route covering
+ * it is dropped.  Changes go through the ordinary add and del, so the
+ * dir24 table sees them as it would any other.  No transaction may be
+ * open: moving a route's data up to its parent deletes the route, and
+ * inside one that would retire data the parent still holds.
+ */
+template <int W>
+struct opt_route {
+  typename btrie_key<W>::type key;
+  unsigned char prefix_len;
+  void *data;
+};
+
+template <int W>
+struct opt_list {
+  opt_route<W> *v;
+  size_t n, a;
+};
+
+template <int W>
+static void opt_push(opt_list<W> *l, const typename btrie_key<W>::type &key,
+                     unsigned char prefix_len, void *data) {
+  if(l->n == l->a) {
+    l->a = l->a ? l->a * 2 : 64;
+    l->v = (opt_route<W> *)realloc(l->v, l->a * sizeof(*l->v));
+  }
+  l->v[l->n].key = key;
+  l->v[l->n].prefix_len = prefix_len;
+  l->v[l->n].data = data;
+  l->n++;
+}
+
+template <int W>
+static int opt_collect(void *ctx, const uint32_t *words,
+                       unsigned char prefix_len, void *data) {
+  opt_push<W>((opt_list<W> *)ctx, btrie_key<W>::from_words(words), prefix_len, data);
+  return 0;
+}
+
+/* a sorts before b: they first differ at a bit b has set */
+template <int W>
+static inline int opt_before(const typename btrie_key<W>::type &a,
+                             const typename btrie_key<W>::type &b) {
+  int c = btrie_key<W>::common(a, b);
+  return c < W && btrie_key<W>::bit(b, c+1);
+}
+
+static void opt_del(btrie4 *tree, uint32_t key, unsigned char prefix_len,
+                    void (*f)(void *)) {
+  del_route_ipv4_key(tree, key, prefix_len, f);
+}
+static void opt_del(btrie6 *tree, const btrie_key<128>::type &key,
+                    unsigned char prefix_len, void (*f)(void *)) {
+  uint32_t words[4];
+  btrie_key<128>::to_words(key, words);
+  del_route_ipv6_key(tree, words, prefix_len, f);
+}
+static void opt_add(btrie4 *tree, uint32_t key, unsigned char prefix_len,
+                    void *data, void (*f)(void *)) {
+  add_route_ipv4_key(tree, key, prefix_len, data, f);
+}
+static void opt_add(btrie6 *tree, const btrie_key<128>::type &key,
+                    unsigned char prefix_len, void *data, void (*f)(void *)) {
+  uint32_t words[4];
+  btrie_key<128>::to_words(key, words);
+  add_route_ipv6_key(tree, words, prefix_len, data, f);
+}
+
+template <int W>
+size_t optimize_tree(btrie_tree<W> *tree, btrie_same_f same, void *ctx,
+                     void (*f)(void *)) {
+  typedef btrie_key<W> K;
+  typedef btrie_collapsed_node<W> node_t;
+  opt_list<W> all = { NULL, 0, 0 }, cur = { NULL, 0, 0 }, up = { NULL, 0, 0 };
+  opt_route<W> *by_len, *stack[W+1];
+  typename K::type zero;
+  size_t start[W+2], fill[W+1], i, j, removed = 0;
+  int l, sp;
+
+  assert(!tree->tx);
+  memset(&zero, 0, sizeof(zero));
+  walk<W>(tree, zero, 0, opt_collect<W>, &all);
+  if(all.n == 0) return 0;
+
+  /* by prefix length, and within a length in address order */
+  memset(start, 0, sizeof(start));
+  for(i=0;i<all.n;i++) start[all.v[i].prefix_len+1]++;
+  for(l=0;l<=W;l++) start[l+1] += start[l];
+  memcpy(fill, start, sizeof(fill));
+  by_len = (opt_route<W> *)malloc(all.n * sizeof(*by_len));
+  for(i=0;i<all.n;i++) by_len[fill[all.v[i].prefix_len]++] = all.v[i];
+
+  for(l=W;l>=1;l--) {
+    /* this length's routes and the parents merged up from below */
+    cur.n = 0;
+    i = start[l];
+    j = 0;
+    while(i < start[l+1] || j < up.n) {
+      if(j < up.n && (i == start[l+1] || !opt_before<W>(by_len[i].key, up.v[j].key))) {
+        /* a merge onto an existing route takes its place */
+        if(i < start[l+1] && K::common(by_len[i].key, up.v[j].key) == W) i++;
+        opt_push<W>(&cur, up.v[j].key, l, up.v[j].data);
+        j++;
+      }
+      else {
+        opt_push<W>(&cur, by_len[i].key, l, by_len[i].data);
+        i++;
+      }
+    }
+    up.n = 0;
+    for(i=0;i+1<cur.n;i++) {
+      opt_route<W> *a = &cur.v[i], *b = &cur.v[i+1];
+      node_t *node;
+      typename K::type parent;
+      if(K::bit(a->key, l) || K::common(a->key, b->key) != l-1 ||
+         !same(ctx, a->data, b->data)) continue;
+      parent = K::mask(a->key, l-1);
+      if(find_bpm_route<W>(tree, parent, l-1, &node, NULL) && !node->incidental)
+        removed++;
+      opt_del(tree, a->key, l, NULL);
+      opt_del(tree, b->key, l, f);
+      opt_add(tree, parent, l-1, a->data, f);
+      opt_push<W>(&up, parent, l-1, a->data);
+      removed++;
+      i++;
+    }
+  }
+  free(by_len);
+
+  /* what is left, in address order: drop routes repeating their cover */
+  all.n = cur.n = 0;
+  walk<W>(tree, zero, 0, opt_collect<W>, &all);
+  sp = 0;
+  for(i=0;i<all.n;i++) {
+    opt_route<W> *r = &all.v[i];
+    while(sp > 0 && K::common(stack[sp-1]->key, r->key) < stack[sp-1]->prefix_len) sp--;
+    if(sp > 0 && same(ctx, stack[sp-1]->data, r->data))
+      opt_push<W>(&cur, r->key, r->prefix_len, r->data);
+    else stack[sp++] = r;
+  }
+  for(i=0;i<cur.n;i++) opt_del(tree, cur.v[i].key, cur.v[i].prefix_len, f);
+  removed += cur.n;
+
+  free(all.v);
+  free(cur.v);
+  free(up.v);
+  return removed;
+}
+
+/*
+ * Relayout.  Churn leaves nodes wherever the free list had room, so the
+ * nodes on one lookup path sit on unrelated cache lines and pages.
+ * compact_tree copies every node into new slabs in lookup order: the
+ * top COMPACT_TOP nodes breadth first, keeping the levels every lookup
+ * crosses packed together, then each subtree hanging below them depth
+ * first, so the rest of a path mostly stays on one or two pages.  The
+ * old slabs and their free list go.  Nodes stay in the ordinary pool,
+ * so the tree is as mutable afterwards as before; no transaction may be
+ * open and nothing may hold a node while it runs.
+ */
+#define COMPACT_TOP SLAB_NODES
+
+template <int W>
+struct compact_move {
+  btrie_collapsed_node<W> *node;
+  btrie_collapsed_node<W> **slot; /* where the copy hangs */
+};
+
+template <int W>
+static btrie_collapsed_node<W> *compact_copy(btrie_tree<W> *tree,
+                                             compact_move<W> m) {
+  btrie_collapsed_node<W> *copy = alloc_node(tree);
+  memcpy(copy, m.node, sizeof(*copy));
+  *m.slot = copy;
+  return copy;
+}
+
+template <int W>
+void compact_tree(btrie_tree<W> *tree) {
+  typedef btrie_collapsed_node<W> node_t;
+  compact_move<W> *queue, stack[W+2], m;
+  btrie_slab<W> *slab, *next, *old = tree->slabs;
+  size_t head = 0, tail = 0, placed = 0;
+  node_t *copy;
+  int sp, b;
+
+  assert(!tree->tx && !tree->retired);
+  if(!tree->root) return;
+  tree->slabs = NULL;
+  tree->free_nodes = NULL;
+  tree->nslabs = tree->nfree = 0;
+
+  /* a node placed breadth first queues at most two more */
+  queue = (compact_move<W> *)malloc((2 * COMPACT_TOP + 1) * sizeof(*queue));
+  queue[tail].node = tree->root;
+  queue[tail++].slot = &tree->root;
+  while(head < tail && placed < COMPACT_TOP) {
+    copy = compact_copy<W>(tree, queue[head++]);
+    placed++;
+    for(b=0;b<2;b++) {
+      if(!copy->bit[b]) continue;
+      queue[tail].node = copy->bit[b];
+      queue[tail++].slot = &copy->bit[b];
+    }
+  }
+  for(; head < tail; head++) {
+    stack[0] = queue[head];
+    sp = 1;
+    while(sp > 0) {
+      m = stack[--sp];
+      copy = compact_copy<W>(tree, m);
+      for(b=1;b>=0;b--) {
+        if(!copy->bit[b]) continue;
+        stack[sp].node = copy->bit[b];
+        stack[sp++].slot = &copy->bit[b];
+      }
+    }
+  }
+  free(queue);
+
+  for(slab = old; slab; slab = next) {
+    next = slab->next;
+    free(slab);
+  }
+}
+
+/*
+ * Bulk insertion.  Input sorted by key and then prefix length, the order
+ * a sorted route dump is in, is built bottom-up in a single pass: a
+ * later prefix never contains an earlier one, so each new node hangs off
+ * the path to the previous one and only that path, kept on a stack, is
+ * ever looked at.  A tree that is not empty to start with, or input
+ * that goes out of order, falls back to add_route for what remains.
+ * Keys must already be masked.
+ */
+template <int W>
+static void add_sorted(btrie_tree<W> *tree,
+                       const typename btrie_key<W>::type *keys,
+                       const unsigned char *lens, void **data, size_t n,
+                       void (*f)(void *)) {
+  typedef btrie_key<W> K;
+  typedef btrie_collapsed_node<W> node_t;
+  node_t *stack[W+1], *top, *child, *node, *branch;
+  int sp = 0, common;
+  size_t i = 0;
+
+  tree->generation++;
+  if(!tree->root) for(; i<n; i++) {
+    assert(lens[i] <= W);
+    if(i > 0) {
+      common = K::common(keys[i-1], keys[i]);
+      if(common < W ? !K::bit(keys[i], common+1) : lens[i] < lens[i-1])
+        break;
+    }
+    child = NULL;
+    while(sp > 0 && (stack[sp-1]->prefix_len > lens[i] ||
+                     !match_bpm<W>(stack[sp-1], keys[i], stack[sp-1]->prefix_len)))
+      child = stack[--sp];
+    top = sp ? stack[sp-1] : NULL;
+    if(top && top->prefix_len == lens[i]) {
+      /* the same prefix again, as add_route would: replace */
+      if(top->incidental) filter_add<W>(tree, keys[i], lens[i]);
+      top->incidental = 0;
+      replace_data<W>(tree, top, data[i], f);
+      continue;
+    }
+
+    node = alloc_node(tree);
+    node->key = keys[i];
+    node->prefix_len = lens[i];
+    node->data = data[i];
+    filter_add<W>(tree, keys[i], lens[i]);
+#ifdef DEBUG_BTRIE
+    describe_node<W>(node);
+#endif
+    if(!child) {
+      /* the first route, or a leaf below the previous one */
+      if(!top) tree->root = node;
+      else {
+        assert(!top->bit[K::bit(keys[i], top->prefix_len+1)]);
+        top->bit[K::bit(keys[i], top->prefix_len+1)] = node;
+      }
+    }
+    else {
+      /* neither contains the other; they part ways at common */
+      common = K::common(child->key, keys[i]);
+      if(top && common == top->prefix_len)
+        top->bit[K::bit(keys[i], common+1)] = node;
+      else {
+        branch = alloc_node(tree);
+        branch->prefix_len = common;
+        branch->incidental = 1;
+        branch->key = K::mask(keys[i], common);
+#ifdef DEBUG_BTRIE
+        describe_node<W>(branch);
+#endif
+        branch->bit[K::bit(child->key, common+1)] = child;
+        branch->bit[K::bit(keys[i], common+1)] = node;
+        if(!top) tree->root = branch;
+        else top->bit[K::bit(keys[i], top->prefix_len+1)] = branch;
+        stack[sp++] = branch;
+      }
+    }
+    stack[sp++] = node;
+  }
+  for(; i<n; i++) add_route<W>(tree, keys[i], lens[i], data[i], f);
+}
+
+void add_routes_ipv4_key(btrie4 *tree, const uint32_t *keys,
+                         const unsigned char *lens, void **data, size_t n,
+                         void (*f)(void *)) {
+  uint32_t *masked;
+  size_t i;
+  if(n == 0) return;
+  masked = (uint32_t *)malloc(n * sizeof(*masked));
+  for(i=0;i<n;i++) masked[i] = btrie_key<32>::mask(keys[i], lens[i]);
+  add_sorted<32>(tree, masked, lens, data, n, f);
+  if(tree->dir)
+    for(i=0;i<n;i++) dir_add(tree->dir, masked[i], lens[i], data[i]);
+  free(masked);
+}
+void add_routes_ipv6_key(btrie6 *tree, const uint32_t *keys,
+                         const unsigned char *lens, void **data, size_t n,
+                         void (*f)(void *)) {
+  typedef btrie_key<128> K;
+  K::type *masked;
+  size_t i;
+  if(n == 0) return;
+  masked = (K::type *)malloc(n * sizeof(*masked));
+  for(i=0;i<n;i++) masked[i] = K::mask(K::from_words(keys + i*4), lens[i]);
+  add_sorted<128>(tree, masked, lens, data, n, f);
+  free(masked);
+}
+
+
+/*
+ * Compiled lookup index.
+ *
+ * A read-only, poptrie-style multibit trie built from a btrie.  The top
+ * POP_DIRECT bits are resolved with a direct-pointing array and the rest
+ * in POP_STRIDE (6) bit steps through nodes whose 64 children are
+ * indexed by popcount over two bitmaps: "vector" marks the children that
+ * are internal nodes (stored contiguously from base1) and "leafvec" marks
+ * where a run of identical leaves starts (stored contiguously from base0).
+ * Leaves and direct entries hold an index into a value table; 0 is "no
+ * route".  An IPv4 lookup that resolves at or above /24 touches the
+ * direct array, one node and one leaf.
+ */
+#define POP_DIRECT 18
+#define POP_STRIDE 6
+#define POP_LEAF 0x80000000
+
+typedef struct {
+  uint64_t vector;
+  uint64_t leafvec;
+  uint32_t base0;
+  uint32_t base1;
+} pop_node;
+
+typedef struct {
+  void *data;
+  unsigned char prefix_len;
+} pop_value;
+
+struct btrie_compiled {
+  unsigned char maxbits;
+  uint32_t *direct;
+  pop_node *nodes;
+  uint32_t nnodes, anodes;
+  uint32_t *leaves;
+  uint32_t nleaves, aleaves;
+  pop_value *values;
+  uint32_t nvalues;
+  void **explicit_nodes; /* sorted, only valid while compiling */
+};
+
+template <int W>
+static void pop_set(typename btrie_key<W>::type &key, int off, int len,
+                    uint32_t v) {
+  int i;
+  for(i=0;i<len && off+i < W;i++)
+    btrie_key<W>::set_bit(key, off+i+1, (v >> (len - 1 - i)) & 1);
+}
+static int pop_ptrcmp(const void *a, const void *b) {
+  uintptr_t pa = (uintptr_t)*(void * const *)a;
+  uintptr_t pb = (uintptr_t)*(void * const *)b;
+  return (pa < pb) ? -1 : (pa > pb) ? 1 : 0;
+}
+static uint32_t pop_value_index(btrie_compiled *c, void *node, void *data) {
+  void **found;
+  if(!node || !data) return 0;
+  found = (void **)bsearch(&node, c->explicit_nodes, c->nvalues - 1,
+                           sizeof(*found), pop_ptrcmp);
+  assert(found);
+  return (found - c->explicit_nodes) + 1;
+}
+static uint32_t pop_alloc_nodes(btrie_compiled *c, uint32_t n) {
+  uint32_t base = c->nnodes;
+  if(c->nnodes + n > c->anodes) {
+    while(c->nnodes + n > c->anodes) c->anodes = c->anodes ? c->anodes*2 : 1024;
+    c->nodes = (pop_node *)realloc(c->nodes, c->anodes * sizeof(*c->nodes));
+  }
+  memset(c->nodes + base, 0, n * sizeof(*c->nodes));
+  c->nnodes += n;
+  return base;
+}
+static uint32_t pop_alloc_leaf(btrie_compiled *c, uint32_t v) {
+  if(c->nleaves == c->aleaves) {
+    c->aleaves = c->aleaves ? c->aleaves*2 : 1024;
+    c->leaves = (uint32_t *)realloc(c->leaves, c->aleaves * sizeof(*c->leaves));
+  }
+  c->leaves[c->nleaves] = v;
+  return c->nleaves++;
+}
+
+/* Given the btrie subtree "sub" holding everything under key/d and the
+ * best explicit route "best" covering it, work out what lies under
+ * key/len (len > d).  Returns 1 and the new (sub, best) if longer
+ * prefixes exist below key/len, or 0 with the covering route in best.
+ */
+template <int W>
+static int
+pop_resolve(btrie_collapsed_node<W> *sub, btrie_collapsed_node<W> *best,
+            const typename btrie_key<W>::type &key, int len,
+            btrie_collapsed_node<W> **rsub, btrie_collapsed_node<W> **rbest) {
+  if(len > W) len = W;
+  while(sub && match_bpm<W>(sub, key, sub->prefix_len < len ?
+                                      sub->prefix_len : len)) {
+    if(sub->prefix_len > len) {
+      *rsub = sub; *rbest = best;
+      return 1;
+    }
+    if(!sub->incidental) best = sub;
+    if(sub->prefix_len == len) {
+      *rsub = sub; *rbest = best;
+      return (sub->bit[0] || sub->bit[1]) ? 1 : 0;
+    }
+    sub = sub->bit[btrie_key<W>::bit(key, sub->prefix_len+1)];
+  }
+  *rbest = best;
+  return 0;
+}
+
+template <int W>
+static void
+pop_build_node(btrie_compiled *c, uint32_t ni,
+               typename btrie_key<W>::type &key, int d,
+               btrie_collapsed_node<W> *sub, btrie_collapsed_node<W> *best) {
+  typedef btrie_collapsed_node<W> node_t;
+  node_t *subs[1 << POP_STRIDE], *bests[1 << POP_STRIDE];
+  uint64_t vector = 0, leafvec = 0;
+  uint32_t base0 = c->nleaves, base1, v, prev = 0, j;
+  int first_leaf = 1;
+
+  for(v=0; v < (1u << POP_STRIDE); v++) {
+    pop_set<W>(key, d, POP_STRIDE, v);
+    if(pop_resolve<W>(sub, best, key, d + POP_STRIDE, &subs[v], &bests[v])) {
+      vector |= (uint64_t)1 << v;
+    }
+    else {
+      uint32_t vi = pop_value_index(c, bests[v], bests[v] ? bests[v]->data : NULL);
+      if(first_leaf || vi != prev) {
+        leafvec |= (uint64_t)1 << v;
+        pop_alloc_leaf(c, vi);
+        prev = vi;
+        first_leaf = 0;
+      }
+    }
+  }
+  pop_set<W>(key, d, POP_STRIDE, 0);
+
+  base1 = pop_alloc_nodes(c, __builtin_popcountll(vector));
+  c->nodes[ni].vector = vector;
+  c->nodes[ni].leafvec = leafvec;
+  c->nodes[ni].base0 = base0;
+  c->nodes[ni].base1 = base1;
+
+  for(v=0, j=0; v < (1u << POP_STRIDE); v++) {
+    if(!(vector & ((uint64_t)1 << v))) continue;
+    pop_set<W>(key, d, POP_STRIDE, v);
+    pop_build_node<W>(c, base1 + j++, key, d + POP_STRIDE, subs[v], bests[v]);
+  }
+  pop_set<W>(key, d, POP_STRIDE, 0);
+}
+
+template <int W>
+btrie_compiled *
+compile_tree(btrie_tree<W> *tree) {
+  typedef typename btrie_key<W>::type bkey_t;
+  typedef btrie_collapsed_node<W> node_t;
+  btrie_compiled *c;
+  node_t *stack[W+2], *node, *sub, *best;
+  bkey_t key;
+  uint32_t v, nexplicit = 0, aexplicit = 0, i;
+  int sp = 0;
+
+  c = (btrie_compiled *)calloc(1, sizeof(*c));
+  c->maxbits = W;
+  c->direct = (uint32_t *)calloc(1 << POP_DIRECT, sizeof(*c->direct));
+
+  /* number the explicit routes; they become the value table */
+  if(tree->root) stack[sp++] = tree->root;
+  while(sp > 0) {
+    node = stack[--sp];
+    if(node->bit[0]) stack[sp++] = node->bit[0];
+    if(node->bit[1]) stack[sp++] = node->bit[1];
+    if(node->incidental || !node->data) continue;
+    if(nexplicit == aexplicit) {
+      aexplicit = aexplicit ? aexplicit*2 : 1024;
+      c->explicit_nodes = (void **)
+        realloc(c->explicit_nodes, aexplicit * sizeof(*c->explicit_nodes));
+    }
+    c->explicit_nodes[nexplicit++] = node;
+  }
+  if(nexplicit)
+    qsort(c->explicit_nodes, nexplicit, sizeof(*c->explicit_nodes), pop_ptrcmp);
+  c->nvalues = nexplicit + 1;
+  c->values = (pop_value *)calloc(c->nvalues, sizeof(*c->values));
+  for(i=0;i<nexplicit;i++) {
+    node = (node_t *)c->explicit_nodes[i];
+    c->values[i+1].data = node->data;
+    c->values[i+1].prefix_len = node->prefix_len;
+  }
+
+  memset(&key, 0, sizeof(key));
+  for(v=0; v < (1u << POP_DIRECT); v++) {
+    pop_set<W>(key, 0, POP_DIRECT, v);
+    if(pop_resolve<W>(tree->root, NULL, key, POP_DIRECT, &sub, &best)) {
+      uint32_t ni = pop_alloc_nodes(c, 1);
+      c->direct[v] = ni;
+      pop_build_node<W>(c, ni, key, POP_DIRECT, sub, best);
+    }
+    else {
+      c->direct[v] = POP_LEAF |
+        pop_value_index(c, best, best ? best->data : NULL);
+    }
+  }
+
+  free(c->explicit_nodes);
+  c->explicit_nodes = NULL;
+  return c;
+}
+
+void drop_compiled(btrie_compiled *c) {
+  if(!c) return;
+  free(c->direct);
+  free(c->nodes);
+  free(c->leaves);
+  free(c->values);
+  free(c);
+}
+
+template <int W>
+static inline uint32_t
+find_compiled(btrie_compiled *c, const typename btrie_key<W>::type &key) {
+  uint32_t idx = c->direct[btrie_key<W>::chunk(key, 0, POP_DIRECT)], v;
+  const pop_node *node;
+  uint64_t bit;
+  int off = POP_DIRECT;
+
+  if(idx & POP_LEAF) return idx & ~POP_LEAF;
+  node = &c->nodes[idx];
+  for(;;) {
+    v = btrie_key<W>::chunk(key, off, POP_STRIDE);
+    bit = (uint64_t)1 << v;
+    if(!(node->vector & bit))
+      return c->leaves[node->base0 +
+                       __builtin_popcountll(node->leafvec & ((bit << 1) - 1)) - 1];
+    node = &c->nodes[node->base1 +
+                     __builtin_popcountll(node->vector & ((bit << 1) - 1)) - 1];
+    off += POP_STRIDE;
+  }
+}
+void *
+find_compiled_ipv4_key(btrie_compiled *c, uint32_t ia, unsigned char *pl) {
+  uint32_t vi = find_compiled<32>(c, ia);
+  if(!vi) return NULL;
+  if(pl) *pl = c->values[vi].prefix_len;
+  return c->values[vi].data;
+}
+void *
+find_compiled_ipv4(btrie_compiled *c, struct in_addr *a, unsigned char *pl) {
+  return find_compiled_ipv4_key(c, ntohl(a->s_addr), pl);
+}
+void *
+find_compiled_ipv6_key(btrie_compiled *c, const uint32_t *words,
+                       unsigned char *pl) {
+  uint32_t vi = find_compiled<128>(c, btrie_key<128>::from_words(words));
+  if(!vi) return NULL;
+  if(pl) *pl = c->values[vi].prefix_len;
+  return c->values[vi].data;
+}
+void *
+find_compiled_ipv6(btrie_compiled *c, struct in6_addr *a, unsigned char *pl) {
+  uint32_t ia[4];
+  ipv6_words(a, ia);
+  return find_compiled_ipv6_key(c, ia, pl);
 }
 
+template void init_tree(btrie4 *);
+template void init_tree(btrie6 *);
+template void drop_tree(btrie4 *, void (*)(void *));
+template void drop_tree(btrie6 *, void (*)(void *));
+template void tree_alloc_stats(btrie4 *, btrie_alloc_stats *);
+template void tree_alloc_stats(btrie6 *, btrie_alloc_stats *);
+template size_t optimize_tree(btrie4 *, btrie_same_f, void *, void (*)(void *));
+template size_t optimize_tree(btrie6 *, btrie_same_f, void *, void (*)(void *));
+template void compact_tree(btrie4 *);
+template void compact_tree(btrie6 *);
+template void tree_shape_stats(btrie4 *, btrie_shape_stats *);
+template void tree_shape_stats(btrie6 *, btrie_shape_stats *);
+template void enable_prefilter(btrie4 *);
+template void enable_prefilter(btrie6 *);
+template void disable_prefilter(btrie4 *);
+template void disable_prefilter(btrie6 *);
+template void tree_begin(btrie4 *);
+template void tree_begin(btrie6 *);
+template btrie_retired *tree_commit(btrie4 *);
+template btrie_retired *tree_commit(btrie6 *);
+template void tree_release(btrie4 *, btrie_retired *, void (*)(void *));
+template void tree_release(btrie6 *, btrie_retired *, void (*)(void *));
+template btrie_compiled *compile_tree(btrie4 *);
+template btrie_compiled *compile_tree(btrie6 *);
@@ -34,17 +34,185 @@
 #define BTRIE_H
 
 #include <arpa/inet.h>
-typedef struct btrie_collapsed_node *btrie;
+#include <stddef.h>
+#include <stdint.h>
 
-void drop_tree(btrie *, void (*)(void *));
-void add_route(btrie *, uint32_t *, unsigned char, void *);
-void add_route_ipv4(btrie *, struct in_addr *, unsigned char, void *);
-void add_route_ipv6(btrie *, struct in6_addr *, unsigned char, void *);
-int del_route_ipv4(btrie *, struct in_addr *, unsigned char,
+/*
+ * A btrie is a path-compressed binary trie of prefixes, specialised at
+ * compile time on the key width W: btrie4 (W = 32) keeps IPv4 nodes
+ * keyed by a single word and btrie6 (W = 128) IPv6 nodes keyed by a pair
+ * of 64 bit words.  The node layout is private to btrie.cc.
+ */
+template <int W> struct btrie_collapsed_node;
+template <int W> struct btrie_slab;
+typedef struct btrie_retired btrie_retired;
+
+template <int W>
+struct btrie_tree {
+  btrie_collapsed_node<W> *root;
+  struct btrie_dir24 *dir; /* IPv4 only */
+  struct btrie_filter *filter;
+  /* node pool */
+  btrie_slab<W> *slabs;
+  btrie_collapsed_node<W> *free_nodes;
+  size_t nslabs, nfree;
+  /* bumped by every change to the routes */
+  uint32_t generation;
+  /* copy-on-write transaction state, see tree_begin */
+  int tx;
+  btrie_collapsed_node<W> **fresh;
+  size_t nfresh, afresh;
+  btrie_retired *retired;
+};
+typedef btrie_tree<32> btrie4;
+typedef btrie_tree<128> btrie6;
+
+typedef struct {
+  size_t slabs;
+  size_t nodes_used;
+  size_t nodes_free;
+  size_t node_size;
+  size_t bytes;
+} btrie_alloc_stats;
+
+/* How the nodes hang together: depth counts nodes at each depth from
+ * the root (0), avg_path the nodes a lookup ending at a route visits. */
+typedef struct {
+  size_t nodes;
+  size_t incidental;
+  size_t routes;
+  size_t depth[130];
+  int max_depth;
+  double avg_path;
+  size_t dir_bytes; /* the dir24 table and prefilter, if enabled */
+} btrie_shape_stats;
+
+template <int W> void init_tree(btrie_tree<W> *);
+template <int W> void drop_tree(btrie_tree<W> *, void (*)(void *));
+template <int W> void tree_alloc_stats(btrie_tree<W> *, btrie_alloc_stats *);
+template <int W> void tree_shape_stats(btrie_tree<W> *, btrie_shape_stats *);
+
+/*
+ * Copy-on-write transactions.  Between tree_begin and tree_commit no node
+ * reachable from the root as it stood at tree_begin is modified: add and
+ * del copy the path down to whatever they change, so a reader still
+ * holding the old root sees the old table whole.  tree_commit returns the
+ * nodes replaced and the data of routes deleted or replaced (NULL if none); once no
+ * reader can hold the old root any longer, tree_release returns the nodes
+ * to the pool and hands the data to f.  Everything committed must be
+ * released before drop_tree.
+ */
+template <int W> void tree_begin(btrie_tree<W> *);
+template <int W> btrie_retired *tree_commit(btrie_tree<W> *);
+template <int W> void tree_release(btrie_tree<W> *, btrie_retired *,
+                                   void (*)(void *));
+
+/* Adding a route that exists replaces its data, and the old data goes
+ * to f as a deleted route's does (or is retired, in a transaction). */
+void add_route_ipv4(btrie4 *, struct in_addr *, unsigned char, void *,
+                    void (*)(void *));
+void add_route_ipv6(btrie6 *, struct in6_addr *, unsigned char, void *,
+                    void (*)(void *));
+int del_route_ipv4(btrie4 *, struct in_addr *, unsigned char,
                    void (*)(void *));
-int del_route_ipv6(btrie *, struct in6_addr *, unsigned char,
+int del_route_ipv6(btrie6 *, struct in6_addr *, unsigned char,
                    void (*)(void *));
-void *find_bpm_route_ipv4(btrie *tree, struct in_addr *a, unsigned char *);
-void *find_bpm_route_ipv6(btrie *tree, struct in6_addr *a, unsigned char *);
+void *find_bpm_route_ipv4(btrie4 *tree, struct in_addr *a, unsigned char *);
+void *find_bpm_route_ipv6(btrie6 *tree, struct in6_addr *a, unsigned char *);
+
+/* The same, taking keys already in host order: a single word for IPv4
+ * and four words, most significant first, for IPv6. */
+void add_route_ipv4_key(btrie4 *, uint32_t, unsigned char, void *,
+                        void (*)(void *));
+void add_route_ipv6_key(btrie6 *, const uint32_t *, unsigned char, void *,
+                        void (*)(void *));
+int del_route_ipv4_key(btrie4 *, uint32_t, unsigned char, void (*)(void *));
+int del_route_ipv6_key(btrie6 *, const uint32_t *, unsigned char,
+                       void (*)(void *));
+void *find_bpm_route_ipv4_key(btrie4 *, uint32_t, unsigned char *);
+void *find_bpm_route_ipv6_key(btrie6 *, const uint32_t *, unsigned char *);
+/* Many routes at once; fastest when sorted by address, then length. */
+void add_routes_ipv4_key(btrie4 *, const uint32_t *, const unsigned char *,
+                         void **, size_t, void (*)(void *));
+void add_routes_ipv6_key(btrie6 *, const uint32_t *, const unsigned char *,
+                         void **, size_t, void (*)(void *));
+void find_bpm_route_ipv4_many(btrie4 *, const uint32_t *, int, void **);
+void find_bpm_route_ipv6_many(btrie6 *, const uint32_t *, int, void **);
+/* Every route covering a key, shortest first: out and lens need room
+ * for W+1 entries.  Returns the count. */
+int find_all_ipv4_key(btrie4 *, uint32_t, void **, unsigned char *);
+int find_all_ipv6_key(btrie6 *, const uint32_t *, void **, unsigned char *);
+/* Every route under a prefix, in address order, until f returns nonzero.
+ * f gets the route's key in host order words (one or four). */
+typedef int (*btrie_walk_f)(void *ctx, const uint32_t *key,
+                            unsigned char prefix_len, void *data);
+int walk_ipv4_key(btrie4 *, uint32_t, unsigned char, btrie_walk_f, void *);
+int walk_ipv6_key(btrie6 *, const uint32_t *, unsigned char, btrie_walk_f,
+                  void *);
+/* Minimization: sibling routes with the same value merge into their
+ * parent and routes repeating the value of the route covering them go,
+ * leaving the value every address matches as it was.  same
+ * says whether two data are the same value; the data of routes removed
+ * is handed to f.  Returns the number of routes removed.  No
+ * transaction may be open. */
+typedef int (*btrie_same_f)(void *ctx, void *a, void *b);
+template <int W> size_t optimize_tree(btrie_tree<W> *, btrie_same_f, void *,
+                                      void (*)(void *));
+/* Relayout: every node copied into new slabs in lookup order (breadth
+ * first at the top, then subtree by subtree) and the free list dropped.
+ * No transaction may be open. */
+template <int W> void compact_tree(btrie_tree<W> *);
+void enable_dir24(btrie4 *);
+void disable_dir24(btrie4 *);
+/* Prefilter: a bitmap of the /20s (IPv4) or, hashed, the /32s (IPv6)
+ * holding or under a route, so that most lookups that can only miss are
+ * answered by one probe of a 128KB table instead of a walk.  Lookups
+ * through the tree check it themselves; prefilter_*_key lets other
+ * indexes of the same routes do the same.  They return 0 only when no
+ * route can match the key. */
+template <int W> void enable_prefilter(btrie_tree<W> *);
+template <int W> void disable_prefilter(btrie_tree<W> *);
+int prefilter_ipv4_key(btrie4 *, uint32_t);
+int prefilter_ipv6_key(btrie6 *, const uint32_t *);
+
+typedef struct btrie_compiled btrie_compiled;
+
+template <int W> btrie_compiled *compile_tree(btrie_tree<W> *);
+void drop_compiled(btrie_compiled *);
+void *find_compiled_ipv4(btrie_compiled *, struct in_addr *, unsigned char *);
+void *find_compiled_ipv6(btrie_compiled *, struct in6_addr *, unsigned char *);
+void *find_compiled_ipv4_key(btrie_compiled *, uint32_t, unsigned char *);
+void *find_compiled_ipv6_key(btrie_compiled *, const uint32_t *,
+                             unsigned char *);
+
+/*
+ * Images: both trees flattened into one position independent buffer
+ * that can be saved to disk and mapped back read-only.  Node data is
+ * replaced by the value number the number callback assigns (1 upward, 0
+ * for none) and the bytes blob returns for each number are stored
+ * alongside; image_value hands them back.  write_image replaces the
+ * file atomically.  The layout is private to btrie_image.cc.
+ */
+typedef struct {
+  void *ctx;
+  uint32_t (*number)(void *ctx, void *data);
+  const void *(*blob)(void *ctx, uint32_t n, uint32_t *len);
+} btrie_image_values;
+
+void *build_image(btrie4 *, btrie6 *, btrie_image_values *, size_t *);
+int write_image(const char *, const void *, size_t);
+const char *check_image(const void *, size_t);
+const void *map_image(const char *, size_t *, const char **);
+void unmap_image(const void *, size_t);
+uint32_t find_image_ipv4_key(const void *, uint32_t, unsigned char *);
+uint32_t find_image_ipv6_key(const void *, const uint32_t *, unsigned char *);
+const void *image_value(const void *, uint32_t, uint32_t *);
+uint32_t image_nvalues(const void *);
+/* Publishing: write_image, then bump_generation on the counter at
+ * path.gen; subscribers map the counter and poll read_generation. */
+uint64_t *map_generation(const char *, int, const char **);
+void unmap_generation(uint64_t *);
+uint64_t bump_generation(uint64_t *);
+uint64_t read_generation(const uint64_t *);
 
 #endif
@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2011, OmniTI Computer Consulting, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name OmniTI Computer Consulting, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "btrie_int.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Trie images.
+ *
+ * An image is a single buffer: a header, the IPv4 and IPv6 nodes in
+ * breadth first order, a value table and the value blobs it points at.
+ * Everything is addressed by offset from the start of the image or by
+ * node index (plus one, so that zero can mean "none"), which makes the
+ * image position independent: it is used in place wherever it is
+ * mapped.  Node data is replaced by a value number handed out by the
+ * caller; value n's bytes are stored verbatim and handed back by
+ * image_value.
+ *
+ * Keys are stored as host order words; the header records the byte
+ * order and check_image refuses images from a different one.  The
+ * checksum covers everything after the checksum field.
+ */
+#define IMAGE_MAGIC "btrieimg"
+#define IMAGE_VERSION 1
+#define IMAGE_BYTEORDER 0x01020304
+#define IMAGE_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+struct image_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+  uint64_t size;
+  uint64_t checksum;
+  uint32_t nodes4, nodes6;
+  uint32_t root4, root6;
+  uint32_t nvalues, pad;
+  uint64_t off_nodes4, off_nodes6, off_values, off_blobs;
+};
+
+template <int W>
+struct image_node {
+  uint32_t bit[2];
+  uint32_t value;
+  uint32_t prefix_len;
+  uint32_t key[W/32];
+};
+
+struct image_value_ent {
+  uint64_t off;
+  uint32_t len, pad;
+};
+
+static uint64_t image_checksum(const struct image_header *h) {
+  const unsigned char *p = (const unsigned char *)(&h->checksum + 1);
+  const unsigned char *end = (const unsigned char *)h + h->size;
+  uint64_t hash = 0xcbf29ce484222325ULL, w;
+  for(; p + 8 <= end; p += 8) {
+    memcpy(&w, p, 8);
+    hash = (hash ^ w) * 0x100000001b3ULL;
+    hash ^= hash >> 29;
+  }
+  for(; p < end; p++) hash = (hash ^ *p) * 0x100000001b3ULL;
+  return hash;
+}
+
+/* Lay the nodes out breadth first; children always follow their parent.
+ * n bounds the nodes reachable from the root; returns how many there
+ * are. */
+template <int W>
+static uint32_t image_nodes(btrie_tree<W> *tree, image_node<W> *out,
+                        uint32_t n, btrie_image_values *vals,
+                        uint32_t *nvalues) {
+  btrie_collapsed_node<W> **queue;
+  uint32_t head = 0, tail = 0;
+  if(!tree->root) return 0;
+  queue = (btrie_collapsed_node<W> **)calloc(n, sizeof(*queue));
+  queue[tail++] = tree->root;
+  while(head < tail) {
+    btrie_collapsed_node<W> *node = queue[head];
+    image_node<W> *in = &out[head++];
+    int b;
+    for(b=0;b<2;b++) {
+      in->bit[b] = 0;
+      if(node->bit[b]) {
+        queue[tail++] = node->bit[b];
+        in->bit[b] = tail;
+      }
+    }
+    in->value = node->incidental ? 0 : vals->number(vals->ctx, node->data);
+    if(in->value > *nvalues) *nvalues = in->value;
+    in->prefix_len = node->prefix_len;
+    btrie_key<W>::to_words(node->key, in->key);
+  }
+  free(queue);
+  return tail;
+}
+
+void *build_image(btrie4 *tree4, btrie6 *tree6, btrie_image_values *vals,
+                  size_t *len) {
+  struct image_header h, *img;
+  btrie_alloc_stats st4, st6;
+  image_node<32> *nodes4;
+  image_node<128> *nodes6;
+  struct image_value_ent *ents;
+  uint64_t off;
+  uint32_t i, nvalues = 0;
+
+  /* nodes in use include any a transaction has replaced but not yet
+   * released, so they only bound the nodes the image needs */
+  tree_alloc_stats(tree4, &st4);
+  tree_alloc_stats(tree6, &st6);
+  nodes4 = (image_node<32> *)calloc(st4.nodes_used + 1, sizeof(*nodes4));
+  nodes6 = (image_node<128> *)calloc(st6.nodes_used + 1, sizeof(*nodes6));
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, IMAGE_MAGIC, 8);
+  h.version = IMAGE_VERSION;
+  h.byteorder = IMAGE_BYTEORDER;
+  h.nodes4 = image_nodes(tree4, nodes4, st4.nodes_used, vals, &nvalues);
+  h.nodes6 = image_nodes(tree6, nodes6, st6.nodes_used, vals, &nvalues);
+  h.root4 = tree4->root ? 1 : 0;
+  h.root6 = tree6->root ? 1 : 0;
+  h.nvalues = nvalues;
+  h.off_nodes4 = IMAGE_ALIGN(sizeof(h));
+  h.off_nodes6 = IMAGE_ALIGN(h.off_nodes4 + h.nodes4 * sizeof(*nodes4));
+  h.off_values = IMAGE_ALIGN(h.off_nodes6 + h.nodes6 * sizeof(*nodes6));
+  h.off_blobs = IMAGE_ALIGN(h.off_values + nvalues * sizeof(*ents));
+  off = h.off_blobs;
+  for(i=1;i<=nvalues;i++) {
+    uint32_t blen;
+    vals->blob(vals->ctx, i, &blen);
+    off = IMAGE_ALIGN(off + blen);
+  }
+  h.size = off;
+
+  img = (struct image_header *)calloc(1, h.size);
+  if(!img) {
+    free(nodes4);
+    free(nodes6);
+    return NULL;
+  }
+  memcpy(img, &h, sizeof(h));
+  memcpy((char *)img + h.off_nodes4, nodes4, h.nodes4 * sizeof(*nodes4));
+  memcpy((char *)img + h.off_nodes6, nodes6, h.nodes6 * sizeof(*nodes6));
+  free(nodes4);
+  free(nodes6);
+  ents = (struct image_value_ent *)((char *)img + h.off_values);
+  off = h.off_blobs;
+  for(i=1;i<=nvalues;i++) {
+    uint32_t blen;
+    const void *blob = vals->blob(vals->ctx, i, &blen);
+    ents[i-1].off = off;
+    ents[i-1].len = blen;
+    if(blen) memcpy((char *)img + off, blob, blen);
+    off = IMAGE_ALIGN(off + blen);
+  }
+  img->checksum = image_checksum(img);
+  *len = h.size;
+  return img;
+}
+
+int write_image(const char *path, const void *img, size_t len) {
+  char tmp[PATH_MAX];
+  size_t done = 0;
+  int fd, err = 0;
+
+  if(snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid()) >= (int)sizeof(tmp)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(fd < 0) return -1;
+  while(done < len) {
+    ssize_t rv = write(fd, (const char *)img + done, len - done);
+    if(rv < 0) {
+      if(errno == EINTR) continue;
+      err = errno;
+      break;
+    }
+    done += rv;
+  }
+  if(!err && fsync(fd) < 0) err = errno;
+  if(close(fd) < 0 && !err) err = errno;
+  /* readers only ever see a complete image */
+  if(!err && rename(tmp, path) < 0) err = errno;
+  if(err) {
+    unlink(tmp);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+template <int W>
+static const char *check_nodes(const struct image_header *h,
+                               uint64_t off, uint32_t n, uint32_t root) {
+  const image_node<W> *nodes;
+  uint32_t i;
+  int b;
+  if(off + (uint64_t)n * sizeof(image_node<W>) > h->size) return "nodes out of bounds";
+  if(root > n || (n && !root)) return "bad root";
+  nodes = (const image_node<W> *)((const char *)h + off);
+  for(i=0;i<n;i++) {
+    if(nodes[i].prefix_len > W) return "bad prefix length";
+    if(nodes[i].value > h->nvalues) return "bad value number";
+    for(b=0;b<2;b++) {
+      uint32_t c = nodes[i].bit[b];
+      if(!c) continue;
+      /* children come later and are longer, so every walk terminates */
+      if(c <= i+1 || c > n) return "bad child index";
+      if(nodes[c-1].prefix_len <= nodes[i].prefix_len) return "bad child prefix";
+    }
+  }
+  return NULL;
+}
+
+const char *check_image(const void *base, size_t len) {
+  const struct image_header *h = (const struct image_header *)base;
+  const struct image_value_ent *ents;
+  const char *err;
+  uint32_t i;
+
+  if(len < sizeof(*h) || memcmp(h->magic, IMAGE_MAGIC, 8)) return "not a trie image";
+  if(h->version != IMAGE_VERSION) return "unsupported image version";
+  if(h->byteorder != IMAGE_BYTEORDER) return "image byte order mismatch";
+  if(h->size != len) return "image size mismatch";
+  if(h->checksum != image_checksum(h)) return "image checksum mismatch";
+  if((err = check_nodes<32>(h, h->off_nodes4, h->nodes4, h->root4)) != NULL) return err;
+  if((err = check_nodes<128>(h, h->off_nodes6, h->nodes6, h->root6)) != NULL) return err;
+  if(h->off_values + (uint64_t)h->nvalues * sizeof(*ents) > h->size)
+    return "value table out of bounds";
+  ents = (const struct image_value_ent *)((const char *)base + h->off_values);
+  for(i=0;i<h->nvalues;i++)
+    if(ents[i].off > h->size || ents[i].len > h->size - ents[i].off)
+      return "value out of bounds";
+  return NULL;
+}
+
+const void *map_image(const char *path, size_t *len, const char **err) {
+  struct stat sb;
+  void *base;
+  int fd;
+
+  *err = NULL;
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    *err = strerror(errno);
+    return NULL;
+  }
+  if(fstat(fd, &sb) < 0) {
+    *err = strerror(errno);
+    close(fd);
+    return NULL;
+  }
+  if(sb.st_size < (off_t)sizeof(struct image_header)) {
+    *err = "not a trie image";
+    close(fd);
+    return NULL;
+  }
+  base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(base == MAP_FAILED) {
+    *err = strerror(errno);
+    return NULL;
+  }
+  if((*err = check_image(base, sb.st_size)) != NULL) {
+    munmap(base, sb.st_size);
+    return NULL;
+  }
+  *len = sb.st_size;
+  return base;
+}
+
+void unmap_image(const void *base, size_t len) {
+  if(base) munmap((void *)base, len);
+}
+
+/*
+ * Publishing.  A published image sits at its path as write_image leaves
+ * it, and beside it, at path.gen, a single 64 bit generation counter
+ * that the publisher bumps once the new image is in place.  Subscribers
+ * map the counter shared and read-only, so noticing a new image costs a
+ * load rather than a system call.  The counter file is created on first
+ * publication.
+ */
+uint64_t *map_generation(const char *path, int writable, const char **err) {
+  char gen[PATH_MAX];
+  struct stat sb;
+  void *base;
+  int fd;
+
+  *err = NULL;
+  if(snprintf(gen, sizeof(gen), "%s.gen", path) >= (int)sizeof(gen)) {
+    *err = strerror(ENAMETOOLONG);
+    return NULL;
+  }
+  fd = writable ? open(gen, O_RDWR|O_CREAT, 0644) : open(gen, O_RDONLY);
+  if(fd < 0) {
+    *err = errno == ENOENT ? "image has not been published" : strerror(errno);
+    return NULL;
+  }
+  if(fstat(fd, &sb) < 0) {
+    *err = strerror(errno);
+    close(fd);
+    return NULL;
+  }
+  if(sb.st_size < (off_t)sizeof(uint64_t)) {
+    /* new, or another publisher is just creating it */
+    if(!writable) *err = "bad generation file";
+    else if(ftruncate(fd, sizeof(uint64_t)) < 0) *err = strerror(errno);
+    if(*err) {
+      close(fd);
+      return NULL;
+    }
+  }
+  base = mmap(NULL, sizeof(uint64_t), writable ? PROT_READ|PROT_WRITE : PROT_READ,
+              MAP_SHARED, fd, 0);
+  close(fd);
+  if(base == MAP_FAILED) {
+    *err = strerror(errno);
+    return NULL;
+  }
+  return (uint64_t *)base;
+}
+
+void unmap_generation(uint64_t *gen) {
+  if(gen) munmap(gen, sizeof(*gen));
+}
+
+uint64_t bump_generation(uint64_t *gen) {
+  return __atomic_add_fetch(gen, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t read_generation(const uint64_t *gen) {
+  return __atomic_load_n(gen, __ATOMIC_ACQUIRE);
+}
+
+template <int W>
+static uint32_t find_image(const struct image_header *h, uint64_t off,
+                           uint32_t idx, const typename btrie_key<W>::type &key,
+                           unsigned char *pl) {
+  typedef btrie_key<W> K;
+  const image_node<W> *nodes = (const image_node<W> *)((const char *)h + off);
+  uint32_t found = 0;
+  while(idx) {
+    const image_node<W> *node = &nodes[idx-1];
+    if(K::common(K::from_words(node->key), key) < (int)node->prefix_len) break;
+    if(node->value) {
+      found = node->value;
+      if(pl) *pl = node->prefix_len;
+    }
+    if(node->prefix_len == W) break;
+    idx = node->bit[K::bit(key, node->prefix_len+1)];
+  }
+  return found;
+}
+
+uint32_t find_image_ipv4_key(const void *base, uint32_t key, unsigned char *pl) {
+  const struct image_header *h = (const struct image_header *)base;
+  return find_image<32>(h, h->off_nodes4, h->root4, key, pl);
+}
+
+uint32_t find_image_ipv6_key(const void *base, const uint32_t *words,
+                             unsigned char *pl) {
+  const struct image_header *h = (const struct image_header *)base;
+  return find_image<128>(h, h->off_nodes6, h->root6,
+                         btrie_key<128>::from_words(words), pl);
+}
+
+const void *image_value(const void *base, uint32_t n, uint32_t *len) {
+  const struct image_header *h = (const struct image_header *)base;
+  const struct image_value_ent *ents;
+  if(n == 0 || n > h->nvalues) return NULL;
+  ents = (const struct image_value_ent *)((const char *)base + h->off_values);
+  *len = ents[n-1].len;
+  return (const char *)base + ents[n-1].off;
+}
+
+uint32_t image_nvalues(const void *base) {
+  return ((const struct image_header *)base)->nvalues;
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2011, OmniTI Computer Consulting, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name OmniTI Computer Consulting, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Node layout and key handling shared by the btrie sources. */
+
+#ifndef BTRIE_INT_H
+#define BTRIE_INT_H
+
+#include "btrie.h"
+
+/*
+ * Key handling, specialised on the key width W (32 or 128).  Keys are
+ * host order integers; bit positions count from 1 at the most
+ * significant end, as prefix lengths do.  Node keys have every bit past
+ * their prefix length cleared.
+ */
+template <int W> struct btrie_key;
+
+template <> struct btrie_key<32> {
+  typedef uint32_t type;
+  static inline int bit(type k, int b) { return (k >> (32 - b)) & 1; }
+  static inline type mask(type k, int len) {
+    if(len >= 32) return k;
+    return (len <= 0) ? 0 : k & ~(0xffffffff >> len);
+  }
+  /* number of leading bits a and b agree on */
+  static inline int common(type a, type b) {
+    type x = a ^ b;
+    return x ? __builtin_clz(x) : 32;
+  }
+  /* len (<= 18) bits starting after the first off; zero past the key */
+  static inline uint32_t chunk(type k, int off, int len) {
+    if(off >= 32) return 0;
+    return (uint32_t)((((uint64_t)k << 32) << off) >> (64 - len));
+  }
+  static inline void set_bit(type &k, int b, int v) {
+    if(v) k |= 0x80000000 >> (b-1);
+    else k &= ~(0x80000000 >> (b-1));
+  }
+  static inline type from_words(const uint32_t *w) { return w[0]; }
+  static inline void to_words(type k, uint32_t *w) { w[0] = k; }
+};
+
+template <> struct btrie_key<128> {
+  struct type { uint64_t hi, lo; };
+  static inline int bit(const type &k, int b) {
+    return (b <= 64) ? (k.hi >> (64 - b)) & 1 : (k.lo >> (128 - b)) & 1;
+  }
+  static inline type mask(type k, int len) {
+    if(len <= 0) k.hi = 0;
+    else if(len < 64) k.hi &= ~(~(uint64_t)0 >> len);
+    if(len <= 64) k.lo = 0;
+    else if(len < 128) k.lo &= ~(~(uint64_t)0 >> (len - 64));
+    return k;
+  }
+  static inline int common(const type &a, const type &b) {
+    uint64_t x = a.hi ^ b.hi;
+    if(x) return __builtin_clzll(x);
+    x = a.lo ^ b.lo;
+    return x ? 64 + __builtin_clzll(x) : 128;
+  }
+  static inline uint32_t chunk(const type &k, int off, int len) {
+    uint64_t v;
+    if(off >= 128) return 0;
+    if(off >= 64) v = k.lo << (off - 64);
+    else v = off ? (k.hi << off) | (k.lo >> (64 - off)) : k.hi;
+    return (uint32_t)(v >> (64 - len));
+  }
+  static inline void set_bit(type &k, int b, int v) {
+    uint64_t &w = (b <= 64) ? k.hi : k.lo;
+    uint64_t m = (uint64_t)1 << (63 - ((b-1) % 64));
+    if(v) w |= m;
+    else w &= ~m;
+  }
+  static inline type from_words(const uint32_t *w) {
+    type k;
+    k.hi = ((uint64_t)w[0] << 32) | w[1];
+    k.lo = ((uint64_t)w[2] << 32) | w[3];
+    return k;
+  }
+  static inline void to_words(const type &k, uint32_t *w) {
+    w[0] = k.hi >> 32; w[1] = (uint32_t)k.hi;
+    w[2] = k.lo >> 32; w[3] = (uint32_t)k.lo;
+  }
+};
+
+template <int W>
+struct btrie_collapsed_node {
+  btrie_collapsed_node *bit[2];
+  void *data;
+  typename btrie_key<W>::type key;
+  unsigned char prefix_len;
+  unsigned char incidental;
+  unsigned char fresh; /* allocated inside the current transaction */
+#ifdef DEBUG_BTRIE
+  char *long_desc;
+#endif
+};
+
+/*
+ * Node pool.  Each tree carves its nodes out of slabs of SLAB_NODES
+ * nodes, handing them out in allocation order and recycling deleted
+ * nodes through a free list (linked through bit[0]).  Free nodes are
+ * marked with an impossible prefix length so that dropping the tree is a
+ * linear sweep over the slabs rather than a recursive walk.
+ */
+#define SLAB_NODES 1024
+#define NODE_FREE 0xff
+
+template <int W>
+struct btrie_slab {
+  btrie_slab *next;
+  uint32_t used;
+  btrie_collapsed_node<W> nodes[SLAB_NODES];
+};
+
+template <int W>
+inline int match_bpm(btrie_collapsed_node<W> *node,
+                     const typename btrie_key<W>::type &key,
+                     unsigned char match_len) {
+  return btrie_key<W>::common(node->key, key) >= match_len;
+}
+
+#endif
@@ -32,218 +32,2605 @@
 
 #include "btrie.h"
 
-#include <v8.h>
-#include <node.h>
-#include <node_object_wrap.h>
+#include <node_api.h>
+#include <uv.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <atomic>
+#include <vector>
 
-using namespace v8;
-using namespace node;
+/*
+ * Node-API plumbing.  Calls made on values whose type has already been
+ * checked do not fail unless an exception is already pending, in which
+ * case whatever the caller goes on to return is ignored; so these hand
+ * back plain values rather than statuses.
+ */
+static napi_value js_undefined(napi_env env) {
+  napi_value v;
+  napi_get_undefined(env, &v);
+  return v;
+}
+static napi_value js_null(napi_env env) {
+  napi_value v;
+  napi_get_null(env, &v);
+  return v;
+}
+static napi_value js_bool(napi_env env, bool b) {
+  napi_value v;
+  napi_get_boolean(env, b, &v);
+  return v;
+}
+static napi_value js_number(napi_env env, double d) {
+  napi_value v;
+  napi_create_double(env, d, &v);
+  return v;
+}
+static napi_value js_bigint(napi_env env, uint64_t u) {
+  napi_value v;
+  napi_create_bigint_uint64(env, u, &v);
+  return v;
+}
+static napi_value js_int(napi_env env, int32_t i) {
+  napi_value v;
+  napi_create_int32(env, i, &v);
+  return v;
+}
+static napi_value js_string(napi_env env, const char *s, size_t len = NAPI_AUTO_LENGTH) {
+  napi_value v;
+  napi_create_string_utf8(env, s, len, &v);
+  return v;
+}
+static napi_value js_object(napi_env env) {
+  napi_value v;
+  napi_create_object(env, &v);
+  return v;
+}
+static napi_value js_array(napi_env env, size_t n) {
+  napi_value v;
+  napi_create_array_with_length(env, n, &v);
+  return v;
+}
+static napi_value js_get(napi_env env, napi_value obj, const char *name) {
+  napi_value v;
+  if(napi_get_named_property(env, obj, name, &v) != napi_ok) return js_undefined(env);
+  return v;
+}
+static void js_set(napi_env env, napi_value obj, const char *name, napi_value v) {
+  napi_set_named_property(env, obj, name, v);
+}
+static napi_value js_at(napi_env env, napi_value arr, uint32_t i) {
+  napi_value v;
+  if(napi_get_element(env, arr, i, &v) != napi_ok) return js_undefined(env);
+  return v;
+}
+static void js_set_at(napi_env env, napi_value arr, uint32_t i, napi_value v) {
+  napi_set_element(env, arr, i, v);
+}
+static uint32_t js_length(napi_env env, napi_value arr) {
+  uint32_t n = 0;
+  napi_get_array_length(env, arr, &n);
+  return n;
+}
+static napi_valuetype js_typeof(napi_env env, napi_value v) {
+  napi_valuetype t = napi_undefined;
+  napi_typeof(env, v, &t);
+  return t;
+}
+static bool js_is_array(napi_env env, napi_value v) {
+  bool b = false;
+  napi_is_array(env, v, &b);
+  return b;
+}
+static bool js_is_buffer(napi_env env, napi_value v) {
+  bool b = false;
+  napi_is_buffer(env, v, &b);
+  return b;
+}
+/* a typed array or DataView */
+static bool js_is_view(napi_env env, napi_value v) {
+  bool b = false;
+  if(napi_is_typedarray(env, v, &b) == napi_ok && b) return true;
+  return napi_is_dataview(env, v, &b) == napi_ok && b;
+}
+static double js_double(napi_env env, napi_value v) {
+  double d = 0;
+  napi_get_value_double(env, v, &d);
+  return d;
+}
+/* a number that is exactly an unsigned 32 bit integer */
+static bool js_is_uint32(napi_env env, napi_value v) {
+  double d;
+  if(js_typeof(env, v) != napi_number) return false;
+  d = js_double(env, v);
+  return d >= 0 && d <= 4294967295.0 && d == (double)(uint32_t)d;
+}
+static uint32_t js_uint32(napi_env env, napi_value v) {
+  uint32_t u = 0;
+  napi_get_value_uint32(env, v, &u);
+  return u;
+}
+static bool js_truthy(napi_env env, napi_value v) {
+  napi_value b;
+  bool r = false;
+  if(napi_coerce_to_bool(env, v, &b) == napi_ok) napi_get_value_bool(env, b, &r);
+  return r;
+}
+static std::string js_utf8(napi_env env, napi_value v) {
+  napi_value s;
+  size_t len = 0;
+  std::string out;
+  if(napi_coerce_to_string(env, v, &s) != napi_ok ||
+     napi_get_value_string_utf8(env, s, NULL, 0, &len) != napi_ok) return out;
+  out.resize(len + 1);
+  napi_get_value_string_utf8(env, s, &out[0], len + 1, &len);
+  out.resize(len);
+  return out;
+}
+static napi_value js_global(napi_env env, const char *name) {
+  napi_value global;
+  napi_get_global(env, &global);
+  return js_get(env, global, name);
+}
+static void js_throw(napi_env env, const char *msg) {
+  napi_throw_error(env, NULL, msg);
+}
+static void js_throw_type(napi_env env, const char *msg) {
+  napi_throw_type_error(env, NULL, msg);
+}
+/* as node's own errors for failed system calls */
+static void js_throw_errno(napi_env env, int err, const char *syscall, const char *path) {
+  std::string msg = std::string(uv_err_name(-err)) + ", " + strerror(err) + " '" + path + "'";
+  napi_value e;
+  napi_create_error(env, js_string(env, uv_err_name(-err)), js_string(env, msg.c_str()), &e);
+  js_set(env, e, "errno", js_int(env, err));
+  js_set(env, e, "syscall", js_string(env, syscall));
+  js_set(env, e, "path", js_string(env, path));
+  napi_throw(env, e);
+}
 
-class IPTrie : public ObjectWrap {
-  public:
-    static Persistent<FunctionTemplate> s_ct;
-    static void
-    Initialize(v8::Handle<v8::Object> target) {
-      Isolate *isolate = target->GetIsolate();
-      HandleScope scope(isolate);
+/*
+ * The bytes behind an ArrayBuffer, SharedArrayBuffer, typed array or
+ * DataView.  Node-API has no call for SharedArrayBuffers, so those are
+ * read through a Uint8Array over them.
+ */
+static bool js_bytes(napi_env env, napi_value v, char **data, size_t *len) {
+  bool is;
+  void *p;
+  if(napi_is_arraybuffer(env, v, &is) == napi_ok && is) {
+    if(napi_get_arraybuffer_info(env, v, &p, len) != napi_ok) return false;
+    *data = (char *)p;
+    return true;
+  }
+  if(napi_is_typedarray(env, v, &is) == napi_ok && is) {
+    napi_typedarray_type type;
+    size_t n;
+    static const size_t width[] = { 1, 1, 1, 2, 2, 4, 4, 4, 8, 8, 8 };
+    if(napi_get_typedarray_info(env, v, &type, &n, &p, NULL, NULL) != napi_ok) return false;
+    *data = (char *)p;
+    *len = n * ((size_t)type < sizeof(width)/sizeof(width[0]) ? width[type] : 1);
+    return true;
+  }
+  if(napi_is_dataview(env, v, &is) == napi_ok && is) {
+    if(napi_get_dataview_info(env, v, len, &p, NULL, NULL) != napi_ok) return false;
+    *data = (char *)p;
+    return true;
+  }
+  napi_value sab = js_global(env, "SharedArrayBuffer"), view;
+  if(js_typeof(env, sab) == napi_function &&
+     napi_instanceof(env, v, sab, &is) == napi_ok && is &&
+     napi_new_instance(env, js_global(env, "Uint8Array"), 1, &v, &view) == napi_ok)
+    return js_bytes(env, view, data, len);
+  return false;
+}
+
+/* per environment: the constructor, for instances made from C++ */
+struct module_t {
+  napi_ref ctor;
+};
 
-      Local<FunctionTemplate> t = FunctionTemplate::New(isolate, New);
-      s_ct.Reset(isolate, t);
-      t->InstanceTemplate()->SetInternalFieldCount(3);
-      t->SetClassName(String::NewFromUtf8(isolate, "IPTrie", String::kInternalizedString));
+class IPTrie {
+  public:
+    static napi_value
+    Initialize(napi_env env, napi_value exports) {
+#define METHOD(name, fn) { name, NULL, fn, NULL, NULL, NULL, napi_default, NULL }
+#define STATIC(name, fn) { name, NULL, fn, NULL, NULL, NULL, napi_static, NULL }
+      napi_property_descriptor props[] = {
+        METHOD("add", Add),
+        METHOD("del", Del),
+        METHOD("find", Find),
+        METHOD("has", Has),
+        METHOD("classify", Classify),
+        METHOD("findMany", FindMany),
+        METHOD("findManyAsync", FindManyAsync),
+        METHOD("findAll", FindAll),
+        METHOD("applyDiff", ApplyDiff),
+        METHOD("walk", Walk),
+        METHOD("drainCounters", DrainCounters),
+        METHOD("value", ValueOf),
+        METHOD("compile", Compile),
+        METHOD("optimize", Optimize),
+        METHOD("compact", Compact),
+        METHOD("allocStats", AllocStats),
+        METHOD("cacheStats", CacheStats),
+        METHOD("stats", Stats),
+        METHOD("save", Save),
+        METHOD("addBulk", AddBulk),
+        METHOD("annotate", Annotate),
+        METHOD("freeze", Freeze),
+        METHOD("publish", Publish),
+        METHOD("generation", Generation),
+        STATIC("fromShared", FromShared),
+        STATIC("fromFile", FromFile),
+        STATIC("load", Load),
+        STATIC("subscribe", Subscribe),
+      };
+#undef METHOD
+#undef STATIC
+      napi_value ctor;
+      module_t *module = new module_t();
+      napi_define_class(env, "IPTrie", NAPI_AUTO_LENGTH, New, NULL,
+                        sizeof(props)/sizeof(props[0]), props, &ctor);
+      napi_create_reference(env, ctor, 1, &module->ctor);
+      napi_set_instance_data(env, module, DropModule, NULL);
+      js_set(env, exports, "IPTrie", ctor);
+      return exports;
+    }
 
-      NODE_SET_PROTOTYPE_METHOD(t, "add", Add);
-      NODE_SET_PROTOTYPE_METHOD(t, "del", Del);
-      NODE_SET_PROTOTYPE_METHOD(t, "find", Find);
+    static void DropModule(napi_env env, void *data, void *hint) {
+      module_t *module = (module_t *)data;
+      napi_delete_reference(env, module->ctor);
+      delete module;
+    }
 
+    /* new IPTrie(...) from C++; NULL having thrown */
+    static napi_value NewInstance(napi_env env, size_t argc, napi_value *argv) {
+      module_t *module;
+      napi_value ctor, obj;
+      napi_get_instance_data(env, (void **)&module);
+      napi_get_reference_value(env, module->ctor, &ctor);
+      if(napi_new_instance(env, ctor, argc, argv, &obj) != napi_ok) return NULL;
+      return obj;
+    }
 
-      target->Set(String::NewFromUtf8(isolate, "IPTrie", String::kInternalizedString),
-                  t->GetFunction());
+    /* the IPTrie behind this, and up to *argc arguments (the rest
+     * undefined); *argc becomes the number actually passed */
+    static IPTrie *Unwrap(napi_env env, napi_callback_info info, size_t *argc,
+                          napi_value *argv, napi_value *self = NULL) {
+      napi_value jsthis;
+      IPTrie *iptrie = NULL;
+      size_t want = argc ? *argc : 0;
+      napi_get_cb_info(env, info, argc, argv, &jsthis, NULL);
+      if(argc && *argc > want) *argc = want;
+      if(self) *self = jsthis;
+      if(napi_unwrap(env, jsthis, (void **)&iptrie) != napi_ok || !iptrie) {
+        js_throw_type(env, "Illegal invocation");
+        return NULL;
+      }
+      return iptrie;
     }
 
+    /*
+     * id is the value index async lookups report, 1 upward.  The value
+     * itself is element id of the values array, so that the trie holds
+     * one reference however many routes it has.
+     */
     struct obj_baton_t {
       IPTrie *iptrie;
-      Persistent<Value> val;
+      uint32_t id;
     };
 
+    obj_baton_t *NewBaton(napi_value dv) {
+      obj_baton_t *baton = new obj_baton_t();
+      baton->iptrie = this;
+      if(!free_ids.empty()) {
+        baton->id = free_ids.back();
+        free_ids.pop_back();
+        batons[baton->id-1] = baton;
+      }
+      else {
+        batons.push_back(baton);
+        baton->id = batons.size();
+      }
+      js_set_at(env, Values(), baton->id, dv);
+      return baton;
+    }
+
+    napi_value Values() {
+      napi_value v;
+      napi_get_reference_value(env, values, &v);
+      return v;
+    }
+
     static void delete_baton(void *vb) {
       obj_baton_t *b = (obj_baton_t *)vb;
       if(!b) return;
-      b->val.Reset();
+      js_set_at(b->iptrie->env, b->iptrie->Values(), b->id, js_undefined(b->iptrie->env));
+      free_baton(b);
+    }
+
+    /* delete_baton without touching JS, for when the trie is collected */
+    static void free_baton(void *vb) {
+      obj_baton_t *b = (obj_baton_t *)vb;
+      if(!b) return;
+      b->iptrie->batons[b->id-1] = NULL;
+      b->iptrie->free_ids.push_back(b->id);
       delete b;
     }
 
-    IPTrie() : tree4(NULL), tree6(NULL) { }
-    ~IPTrie() {
-      drop_tree(&tree4, delete_baton);
-      drop_tree(&tree6, delete_baton);
+    /*
+     * Route data.  By default every route holds its own obj_baton_t with
+     * its value in the values array.  In VALUES_INTERN mode routes with
+     * equal values share one baton, found through the interned map by
+     * ValueKey, and batons live as long as the trie.  In VALUES_INTEGER
+     * mode the data pointer is the value itself plus one (no route may
+     * hold NULL) and nothing is stored at all.  Either way a big table
+     * with few distinct values costs the GC next to nothing.  In
+     * VALUES_LISTS mode each route holds a list_route_t, below.
+     */
+    enum value_mode_t { VALUES_OBJECT, VALUES_INTERN, VALUES_INTEGER, VALUES_LISTS };
+
+    /* a route in lists mode: the lists it is in, bit n for list n, and
+     * with precompute those of every route covering it as well */
+    struct list_route_t {
+      uint64_t own, all;
+    };
+
+    static void free_list_route(void *r) {
+      delete (list_route_t *)r;
     }
 
-    int Add(const char *ip, int prefix, Handle<Value> dv) {
-      int family, rv;
-      union {
-        struct in_addr addr4;
-        struct in6_addr addr6;
-      } a;
+    /* Tagged bytes for a primitive: 's' and UTF-8 for strings, 'n' and a
+     * double for numbers, 't', 'f' and 'z' for true, false and null.
+     * Returns false for anything else. */
+    static bool ValueKey(napi_env env, napi_value v, std::string &key) {
+      switch(js_typeof(env, v)) {
+        case napi_string:
+          key = "s" + js_utf8(env, v);
+          break;
+        case napi_number: {
+          double d = js_double(env, v);
+          key = "n";
+          key.append((const char *)&d, sizeof(d));
+          break;
+        }
+        case napi_boolean:
+          key = js_truthy(env, v) ? "t" : "f";
+          break;
+        case napi_null:
+          key = "z";
+          break;
+        default:
+          return false;
+      }
+      return true;
+    }
+
+    /*
+     * Hit counters.  With counters on, each route's data is a
+     * counted_route_t around what it would otherwise hold, so whichever
+     * path a lookup takes (tree, dir24, compiled index or cache) the
+     * route it lands on is at hand to count.  The counts are relaxed
+     * atomics, bumped by async workers too, and drained by exchange.
+     */
+    struct counted_route_t {
+      void *data;
+      std::atomic<uint64_t> packets, bytes;
+    };
+
+    static void free_counted(void *d) {
+      delete (counted_route_t *)d;
+    }
+
+    static void delete_counted_baton(void *d) {
+      delete_baton(((counted_route_t *)d)->data);
+      free_counted(d);
+    }
+
+    static void free_counted_baton(void *d) {
+      free_baton(((counted_route_t *)d)->data);
+      free_counted(d);
+    }
+
+    /* a route's data as the value mode has it */
+    void *Inner(void *d) {
+      return counting && d ? ((counted_route_t *)d)->data : d;
+    }
+
+    void Count(void *d, uint64_t bytes) {
+      counted_route_t *c = (counted_route_t *)d;
+      if(!counting || !c) return;
+      c->packets.fetch_add(1, std::memory_order_relaxed);
+      if(bytes) c->bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    /* returns NULL having thrown when the value does not suit the mode */
+    void *NewData(napi_value dv) {
+      return Counted(NewValue(dv));
+    }
 
-      family = AF_INET;
-      rv = inet_pton(family, ip, &a);
-      if(rv != 1) {
-        family = AF_INET6;
-        rv = inet_pton(family, ip, &a);
-        if(rv != 1) {
-          return 0;
+    /* route data for d, a value as the value mode holds it */
+    void *Counted(void *d) {
+      if(!d || !counting) return d;
+      counted_route_t *c = new counted_route_t();
+      c->data = d;
+      c->packets = 0;
+      c->bytes = 0;
+      return c;
+    }
+
+    void *NewValue(napi_value dv) {
+      const char *err = NULL;
+      if(value_mode == VALUES_INTEGER) {
+        if(js_is_uint32(env, dv) && js_uint32(env, dv) < 0x80000000)
+          return (void *)((uintptr_t)js_uint32(env, dv) + 1);
+        err = "Value must be an integer from 0 to 2147483647";
+      }
+      else if(value_mode == VALUES_INTERN) {
+        std::string key;
+        if(ValueKey(env, dv, key)) {
+          obj_baton_t *&b = interned[key];
+          if(!b) b = NewBaton(dv);
+          return b;
         }
+        err = "Value must be a string, number, boolean or null";
       }
-      obj_baton_t *baton = new obj_baton_t();
-      baton->iptrie = this;
-      baton->val.Reset(Isolate::GetCurrent(), dv);
+      else if(value_mode == VALUES_LISTS)
+        err = "Routes in lists mode are added one list at a time";
+      else return NewBaton(dv);
+      js_throw_type(env, err);
+      return NULL;
+    }
+
+    napi_value DataValue(void *d) {
+      d = Inner(d);
+      if(value_mode == VALUES_INTEGER)
+        return js_int(env, (int32_t)((uintptr_t)d - 1));
+      if(value_mode == VALUES_LISTS)
+        return js_bigint(env, ((list_route_t *)d)->own);
+      return js_at(env, Values(), ((obj_baton_t *)d)->id);
+    }
+
+    uint32_t DataId(void *d) {
+      if(!d) return 0;
+      d = Inner(d);
+      if(value_mode == VALUES_INTEGER) return (uint32_t)(uintptr_t)d;
+      return ((obj_baton_t *)d)->id;
+    }
+
+    /* what a route's data needs when the route goes */
+    void (*DataFree())(void *) {
+      if(value_mode == VALUES_LISTS) return free_list_route;
+      if(counting) return value_mode == VALUES_OBJECT ? delete_counted_baton : free_counted;
+      return value_mode == VALUES_OBJECT ? delete_baton : NULL;
+    }
+
+    IPTrie(napi_env env) : env(env), self(NULL), values(NULL),
+               value_mode(VALUES_OBJECT), precompute(false), counting(false), compiled4(NULL), compiled6(NULL),
+               image(NULL), image_len(0), image_values(NULL), image_owner(NULL),
+               published(NULL), generation(0), epoch(0), running(0),
+               cache(NULL), cache_mask(0), cache_hits(0), cache_misses(0) {
+      memset(&ops, 0, sizeof(ops));
+      init_tree(&tree4);
+      init_tree(&tree6);
+    }
+    /* only ever run as the object is collected, so JS is left alone */
+    ~IPTrie() {
+      if(compiled4) drop_compiled(compiled4);
+      if(compiled6) drop_compiled(compiled6);
+      void (*f)(void *) = value_mode != VALUES_OBJECT ? DataFree() :
+                          counting ? free_counted_baton : free_baton;
+      drop_tree(&tree4, f);
+      drop_tree(&tree6, f);
+      for(std::map<std::string, obj_baton_t *>::iterator it = interned.begin();
+          it != interned.end(); ++it)
+        free_baton(it->second);
+      free(cache);
+      if(image) {
+        napi_delete_reference(env, image_values);
+        if(!image_owner) unmap_image(image, image_len);
+        else napi_delete_reference(env, image_owner);
+      }
+      unmap_generation(published);
+      napi_delete_reference(env, values);
+      napi_delete_reference(env, self);
+    }
+
+    static void Finalize(napi_env env, void *data, void *hint) {
+      delete (IPTrie *)data;
+    }
+
+    void Invalidate(int family) {
+      if(family == AF_INET) {
+        if(compiled4) Retire(NULL, NULL, compiled4, NULL);
+        compiled4 = NULL;
+      }
+      else {
+        if(compiled6) Retire(NULL, NULL, NULL, compiled6);
+        compiled6 = NULL;
+      }
+    }
+
+    /* indexes are only built here: one an update has made stale stays
+     * dropped, and lookups in that family go to the trie, until the
+     * next compile() */
+    void Compile() {
+      if(!compiled4) compiled4 = compile_tree(&tree4);
+      if(!compiled6) compiled6 = compile_tree(&tree6);
+    }
+
+    /* keys are host order words, one per IPv4 address or four per IPv6 */
+    int Add(int family, const uint32_t *key, int prefix, napi_value dv) {
+      void *data = NewData(dv);
+      if(!data) return 0;
 
-      if(family==AF_INET) add_route_ipv4(&tree4, &a.addr4, prefix, baton);
-      else add_route_ipv6(&tree6, &a.addr6, prefix, baton);
+      Invalidate(family);
+      if(family==AF_INET) add_route_ipv4_key(&tree4, key[0], prefix, data, DataFree());
+      else add_route_ipv6_key(&tree6, key, prefix, data, DataFree());
+      ops.add++;
       return 1;
     }
 
-    int Del(const char *ip, int prefix) {
-      int family, rv;
-      union {
-        struct in_addr addr4;
-        struct in6_addr addr6;
-      } a;
+    int Del(int family, const uint32_t *key, int prefix) {
+      int rv;
+      if(family==AF_INET) rv = del_route_ipv4_key(&tree4, key[0], prefix, DataFree());
+      else rv = del_route_ipv6_key(&tree6, key, prefix, DataFree());
+      if(rv) Invalidate(family);
+      ops.del += rv;
+      return rv;
+    }
+
+    /*
+     * Lists mode.  A route is in up to 64 lists at once; adding it to
+     * another list sets a bit in the existing route rather than
+     * replacing it.  Classify ORs together the lists of every route
+     * covering an address.  With precompute each route also keeps that
+     * OR for itself in all, redone beneath a prefix whenever it changes,
+     * so that classify is one best-prefix lookup through the cache and
+     * compiled index like any find.
+     */
+    list_route_t *ListRoute(int family, const uint32_t *key, int prefix_len,
+                            uint64_t *above) {
+      void *out[129];
+      unsigned char lens[129];
+      list_route_t *r = NULL;
+      int i, n;
+      if(family == AF_INET) n = find_all_ipv4_key(&tree4, key[0], out, lens);
+      else n = find_all_ipv6_key(&tree6, key, out, lens);
+      /* shortest first, so the last shorter route is the nearest */
+      if(above) *above = 0;
+      for(i=0;i<n && lens[i]<=prefix_len;i++) {
+        if(lens[i] == prefix_len) r = (list_route_t *)out[i];
+        else if(above) *above = ((list_route_t *)out[i])->all;
+      }
+      return r;
+    }
+
+    struct inherit_route_t {
+      uint32_t key[4];
+      unsigned char prefix_len;
+      uint64_t all;
+    };
+    struct inherit_ctx_t {
+      int width;
+      uint64_t above;
+      /* the routes covering the one visited, outermost first */
+      std::vector<inherit_route_t> covering;
+    };
+
+    static bool Covers(int width, const uint32_t *outer, int len, const uint32_t *key) {
+      int i;
+      for(i=0;i<width && len>0;i++, len-=32) {
+        uint32_t mask = len >= 32 ? 0xffffffff : ~(0xffffffff >> len);
+        if((outer[i] ^ key[i]) & mask) return false;
+      }
+      return true;
+    }
+
+    /* walk visits a route before those beneath it */
+    static int inherit_route(void *vctx, const uint32_t *key,
+                             unsigned char prefix_len, void *data) {
+      inherit_ctx_t *ctx = (inherit_ctx_t *)vctx;
+      list_route_t *r = (list_route_t *)data;
+      inherit_route_t c;
+      while(!ctx->covering.empty() &&
+            !Covers(ctx->width, ctx->covering.back().key,
+                    ctx->covering.back().prefix_len, key))
+        ctx->covering.pop_back();
+      r->all = r->own | (ctx->covering.empty() ? ctx->above : ctx->covering.back().all);
+      memcpy(c.key, key, ctx->width * sizeof(uint32_t));
+      c.prefix_len = prefix_len;
+      c.all = r->all;
+      ctx->covering.push_back(c);
+      return 0;
+    }
+
+    void Inherit(int family, const uint32_t *key, int prefix_len) {
+      inherit_ctx_t ctx;
+      ctx.width = family == AF_INET ? 1 : 4;
+      ListRoute(family, key, prefix_len, &ctx.above);
+      if(family == AF_INET) walk_ipv4_key(&tree4, key[0], prefix_len, inherit_route, &ctx);
+      else walk_ipv6_key(&tree6, key, prefix_len, inherit_route, &ctx);
+    }
+
+    void AddList(int family, const uint32_t *key, int prefix_len, int list) {
+      list_route_t *r = ListRoute(family, key, prefix_len, NULL);
+      if(r) r->own |= (uint64_t)1 << list;
+      else {
+        r = new list_route_t();
+        r->own = (uint64_t)1 << list;
+        Invalidate(family);
+        if(family==AF_INET) add_route_ipv4_key(&tree4, key[0], prefix_len, r, DataFree());
+        else add_route_ipv6_key(&tree6, key, prefix_len, r, DataFree());
+      }
+      if(precompute) Inherit(family, key, prefix_len);
+      ops.add++;
+    }
 
-      family = AF_INET;
-      rv = inet_pton(family, ip, &a);
-      if(rv != 1) {
-        family = AF_INET6;
-        rv = inet_pton(family, ip, &a);
-        if(rv != 1) {
-          return 0;
+    /* takes the route out of one list, or with list -1 out of all */
+    int DelList(int family, const uint32_t *key, int prefix_len, int list) {
+      list_route_t *r = ListRoute(family, key, prefix_len, NULL);
+      int rv = 1;
+      if(!r) return 0;
+      if(list >= 0) {
+        if(!(r->own & ((uint64_t)1 << list))) return 0;
+        r->own &= ~((uint64_t)1 << list);
+      }
+      if(list < 0 || !r->own) rv = Del(family, key, prefix_len);
+      else ops.del++;
+      if(precompute) Inherit(family, key, prefix_len);
+      return rv;
+    }
+
+    uint64_t Classify(int family, const uint32_t *key) {
+      void *out[129];
+      unsigned char lens[129];
+      uint64_t lists = 0;
+      int i, n;
+      if(precompute) {
+        list_route_t *r = (list_route_t *)Find(family, key);
+        CountFinds(1, r != NULL);
+        return r ? r->all : 0;
+      }
+      if(family == AF_INET) n = find_all_ipv4_key(&tree4, key[0], out, lens);
+      else n = find_all_ipv6_key(&tree6, key, out, lens);
+      for(i=0;i<n;i++) lists |= ((list_route_t *)out[i])->own;
+      CountFinds(1, n > 0);
+      return lists;
+    }
+
+    /* n lookups made, hits of them found a route */
+    void CountFinds(size_t n, size_t hits) {
+      ops.find += n;
+      ops.hit += hits;
+      ops.miss += n - hits;
+    }
+
+    /*
+     * Lookup cache.  An optional set associative cache of CACHE_WAYS way
+     * sets, keyed by binary address, remembering what Find returned (a
+     * miss included).  Each entry records the generation of its family's
+     * trie when it was filled; every add or del bumps the generation, so
+     * stale entries simply stop matching.
+     */
+    static const int CACHE_WAYS = 4;
+    struct cache_entry_t {
+      uint32_t key[4];
+      uint32_t generation;
+      int family; /* 0 when empty */
+      void *val;
+    };
+
+    void EnableCache(uint32_t entries) {
+      uint32_t sets = 1;
+      while(sets * CACHE_WAYS < entries && sets < (1 << 24)) sets <<= 1;
+      free(cache);
+      cache = (cache_entry_t *)calloc(sets * CACHE_WAYS, sizeof(*cache));
+      cache_mask = sets - 1;
+    }
+
+    cache_entry_t *CacheSet(int family, const uint32_t *key) {
+      uint32_t h = key[0] * 0x9e3779b1;
+      if(family == AF_INET6)
+        h = (h ^ key[1]) * 0x85ebca6b ^ (key[2] ^ key[3]) * 0xc2b2ae35;
+      h ^= h >> 15;
+      return cache + (h & cache_mask) * CACHE_WAYS;
+    }
+
+    void *Find(int family, const uint32_t *key) {
+      cache_entry_t *set, *e;
+      void *d;
+      int i, words = family == AF_INET ? 1 : 4;
+      uint32_t generation = family == AF_INET ? tree4.generation : tree6.generation;
+      if(!cache) return FindUncached(family, key);
+
+      set = CacheSet(family, key);
+      for(i=0;i<CACHE_WAYS;i++) {
+        e = &set[i];
+        if(e->family == family && e->generation == generation &&
+           !memcmp(e->key, key, words * sizeof(uint32_t))) {
+          cache_hits++;
+          return e->val;
         }
       }
-      if(family==AF_INET) return del_route_ipv4(&tree4, &a.addr4, prefix, delete_baton);
-      else return del_route_ipv6(&tree6, &a.addr6, prefix, delete_baton);
+      cache_misses++;
+      d = FindUncached(family, key);
+      /* take a stale way if there is one, else any */
+      e = &set[cache_misses % CACHE_WAYS];
+      for(i=0;i<CACHE_WAYS;i++) {
+        if(!set[i].family || set[i].generation !=
+           (set[i].family == AF_INET ? tree4.generation : tree6.generation)) {
+          e = &set[i];
+          break;
+        }
+      }
+      memcpy(e->key, key, words * sizeof(uint32_t));
+      e->family = family;
+      e->generation = generation;
+      e->val = d;
+      return d;
     }
 
-    obj_baton_t *Find(const char *query) {
-      int family, rv;
+    void *FindUncached(int family, const uint32_t *key) {
       unsigned char pl;
+      if(family==AF_INET ? compiled4 : compiled6) {
+        if(!Prefilter(family, key)) return NULL;
+        if(family==AF_INET) return find_compiled_ipv4_key(compiled4, key[0], &pl);
+        else return find_compiled_ipv6_key(compiled6, key, &pl);
+      }
+      if(family==AF_INET) return find_bpm_route_ipv4_key(&tree4, key[0], &pl);
+      else return find_bpm_route_ipv6_key(&tree6, key, &pl);
+    }
+
+    /* the trees check their prefilters themselves; the compiled
+     * indexes leave it to us */
+    int Prefilter(int family, const uint32_t *key) {
+      if(family==AF_INET) return prefilter_ipv4_key(&tree4, key[0]);
+      return prefilter_ipv6_key(&tree6, key);
+    }
+
+    void FindMany(int family, const uint32_t *keys, int n, void **out) {
+      int i;
+      if(family==AF_INET ? compiled4 : compiled6) {
+        for(i=0;i<n;i++) {
+          if(!Prefilter(family, family==AF_INET ? keys + i : keys + i*4))
+            out[i] = NULL;
+          else if(family==AF_INET)
+            out[i] = find_compiled_ipv4_key(compiled4, keys[i], NULL);
+          else
+            out[i] = find_compiled_ipv6_key(compiled6, keys + i*4, NULL);
+        }
+        return;
+      }
+      if(family==AF_INET) find_bpm_route_ipv4_many(&tree4, keys, n, out);
+      else find_bpm_route_ipv6_many(&tree6, keys, n, out);
+    }
+
+    /*
+     * Bulk loading.  Each "address/length value" line becomes a route;
+     * the value is the rest of the line, or with line_values the line's
+     * index.  Lines that do not parse are skipped.  Routes are handed to
+     * the trie a family at a time, which builds sorted input in one pass.
+     */
+    int AddBulk(const char *p, size_t len, bool line_values) {
+      const char *end = p + len;
+      std::vector<uint32_t> keys4, keys6;
+      std::vector<unsigned char> lens4, lens6;
+      std::vector<void *> data4, data6;
+      int line;
+
+      for(line = 0; p < end; line++) {
+        const char *eol = (const char *)memchr(p, '\n', end - p);
+        const char *slash, *v, *vend;
+        char ip[INET6_ADDRSTRLEN];
+        uint32_t key[4];
+        int family, prefix_len = 0;
+        if(!eol) eol = end;
+        slash = (const char *)memchr(p, '/', eol - p);
+        if(!slash || slash - p >= (int)sizeof(ip) || slash + 1 == eol ||
+           *(slash+1) < '0' || *(slash+1) > '9') {
+          p = eol + 1;
+          continue;
+        }
+        memcpy(ip, p, slash - p);
+        ip[slash - p] = '\0';
+        for(v = slash + 1; v < eol && *v >= '0' && *v <= '9' && prefix_len <= 128; v++)
+          prefix_len = prefix_len * 10 + (*v - '0');
+        family = ParseAddress(ip, key);
+        if(family == 0 || prefix_len > (family == AF_INET ? 32 : 128) ||
+           v == eol || (*v != ' ' && *v != '\t')) {
+          p = eol + 1;
+          continue;
+        }
+        while(v < eol && (*v == ' ' || *v == '\t')) v++;
+        for(vend = eol; vend > v && (vend[-1] == '\r' || vend[-1] == ' ' || vend[-1] == '\t'); vend--);
+
+        void *data;
+        if(line_values) data = NewData(js_int(env, line));
+        else if(value_mode == VALUES_INTERN) {
+          /* a repeated label costs a map probe, not a new string */
+          std::string k("s");
+          k.append(v, vend - v);
+          obj_baton_t *&b = interned[k];
+          if(!b) b = NewBaton(js_string(env, v, vend - v));
+          data = Counted(b);
+        }
+        else data = NewData(js_string(env, v, vend - v));
+        if(!data) {
+          void (*f)(void *) = DataFree();
+          size_t i;
+          for(i=0;f && i<data4.size();i++) f(data4[i]);
+          for(i=0;f && i<data6.size();i++) f(data6[i]);
+          return -1;
+        }
+        if(family == AF_INET) {
+          keys4.push_back(key[0]);
+          lens4.push_back(prefix_len);
+          data4.push_back(data);
+        }
+        else {
+          keys6.insert(keys6.end(), key, key + 4);
+          lens6.push_back(prefix_len);
+          data6.push_back(data);
+        }
+        p = eol + 1;
+      }
+      if(!data4.empty()) {
+        Invalidate(AF_INET);
+        add_routes_ipv4_key(&tree4, &keys4[0], &lens4[0], &data4[0], data4.size(),
+                            DataFree());
+      }
+      if(!data6.empty()) {
+        Invalidate(AF_INET6);
+        add_routes_ipv6_key(&tree6, &keys6[0], &lens6[0], &data6[0], data6.size(),
+                            DataFree());
+      }
+      ops.add += data4.size() + data6.size();
+      return data4.size() + data6.size();
+    }
+
+    /*
+     * Log annotation.  Lines are scanned where they lie, the address
+     * field read by hand for IPv4 (inet_pton only sees IPv6), and the
+     * lookups made ANNOTATE_BATCH lines at a time so that they go through
+     * the interleaved batch walk.  Each line is written out with the
+     * label of its match appended; a value's label is formatted once.
+     */
+    static const int ANNOTATE_BATCH = 256;
+
+    struct annotate_t {
+      int field;
+      std::string separator, missing;
+      /* the caller's buffer until it runs out, then our own */
+      char *out;
+      size_t len, cap;
+      bool owned;
+      std::map<uintptr_t, std::string> labels;
+    };
+
+    static bool ParseQuad(const char *p, const char *end, uint32_t *key) {
+      uint32_t a = 0, v = 0;
+      int parts = 0, digits = 0;
+      for(; p < end; p++) {
+        unsigned c = (unsigned char)*p - '0';
+        if(c <= 9) {
+          if(++digits > 3) return false;
+          v = v * 10 + c;
+        }
+        else if(*p == '.' && digits && parts < 3 && v <= 255) {
+          a = (a << 8) | v;
+          v = 0;
+          digits = 0;
+          parts++;
+        }
+        else return false;
+      }
+      if(parts != 3 || !digits || v > 255) return false;
+      *key = (a << 8) | v;
+      return true;
+    }
+
+    /* the family of the address in whitespace separated field n, or 0 */
+    static int FieldAddress(const char *p, const char *eol, int n, uint32_t *key) {
+      const char *e;
+      char ip[INET6_ADDRSTRLEN];
+      for(;;) {
+        while(p < eol && (*p == ' ' || *p == '\t')) p++;
+        if(p == eol) return 0;
+        for(e = p; e < eol && *e != ' ' && *e != '\t' && *e != '\r'; e++);
+        if(n-- == 0) break;
+        p = e;
+      }
+      if(ParseQuad(p, e, key)) return AF_INET;
+      if(e - p >= (int)sizeof(ip) || !memchr(p, ':', e - p)) return 0;
+      memcpy(ip, p, e - p);
+      ip[e - p] = '\0';
+      return ParseAddress(ip, key);
+    }
+
+    static void AnnotateWrite(annotate_t *a, const char *p, size_t len) {
+      if(a->len + len > a->cap) {
+        size_t cap = a->cap * 2 > a->len + len ? a->cap * 2 : a->len + len;
+        char *out = (char *)malloc(cap);
+        memcpy(out, a->out, a->len);
+        if(a->owned) free(a->out);
+        a->out = out;
+        a->cap = cap;
+        a->owned = true;
+      }
+      memcpy(a->out + a->len, p, len);
+      a->len += len;
+    }
+
+
+    const std::string &AnnotateLabel(annotate_t *a, uintptr_t k) {
+      if(!k) return a->missing;
+      std::map<uintptr_t, std::string>::iterator it = a->labels.find(k);
+      if(it != a->labels.end()) return it->second;
+      napi_value v = image ? ImageValue(k) : DataValue((void *)k);
+      return a->labels[k] = js_utf8(env, v);
+    }
+
+    void Annotate(annotate_t *a, const char *p, size_t len) {
+      const char *end = p + len, *lines[ANNOTATE_BATCH + 1];
+      uint32_t keys4[ANNOTATE_BATCH], keys6[ANNOTATE_BATCH * 4];
+      void *found4[ANNOTATE_BATCH], *found6[ANNOTATE_BATCH];
+      int family[ANNOTATE_BATCH], slot[ANNOTATE_BATCH];
+      int i, n, n4, n6;
+
+      while(p < end) {
+        for(n = n4 = n6 = 0; n < ANNOTATE_BATCH && p < end; n++) {
+          const char *eol = (const char *)memchr(p, '\n', end - p);
+          uint32_t key[4];
+          if(!eol) eol = end;
+          lines[n] = p;
+          family[n] = FieldAddress(p, eol, a->field, key);
+          if(family[n] == AF_INET) {
+            slot[n] = n4;
+            keys4[n4++] = key[0];
+          }
+          else if(family[n] == AF_INET6) {
+            slot[n] = n6;
+            memcpy(keys6 + 4 * n6++, key, sizeof(key));
+          }
+          p = eol < end ? eol + 1 : end;
+        }
+        lines[n] = p;
+        if(image) {
+          for(i=0;i<n4;i++) found4[i] = (void *)(uintptr_t)ImageFind(AF_INET, keys4 + i);
+          for(i=0;i<n6;i++) found6[i] = (void *)(uintptr_t)ImageFind(AF_INET6, keys6 + 4*i);
+        }
+        else {
+          if(n4) FindMany(AF_INET, keys4, n4, found4);
+          if(n6) FindMany(AF_INET6, keys6, n6, found6);
+        }
+        int hits = 0;
+        for(i=0;i<n4;i++) hits += found4[i] != NULL;
+        for(i=0;i<n6;i++) hits += found6[i] != NULL;
+        CountFinds(n4 + n6, hits);
+        if(counting) {
+          for(i=0;i<n4;i++) Count(found4[i], 0);
+          for(i=0;i<n6;i++) Count(found6[i], 0);
+        }
+        for(i=0;i<n;i++) {
+          const char *body = lines[i], *eol = lines[i+1];
+          void *d = family[i] == AF_INET ? found4[slot[i]] :
+                    family[i] == AF_INET6 ? found6[slot[i]] : NULL;
+          const std::string &label = AnnotateLabel(a, (uintptr_t)d);
+          /* the label goes before the line ending, \n or \r\n */
+          if(eol > body && eol[-1] == '\n') eol--;
+          if(eol > body && eol[-1] == '\r') eol--;
+          AnnotateWrite(a, body, eol - body);
+          AnnotateWrite(a, a->separator.data(), a->separator.size());
+          AnnotateWrite(a, label.data(), label.size());
+          AnnotateWrite(a, eol, lines[i+1] - eol);
+        }
+      }
+    }
+
+
+    static bool LineValues(napi_env env, napi_value opts) {
+      if(js_typeof(env, opts) != napi_object) return false;
+      napi_value v = js_get(env, opts, "values");
+      if(js_typeof(env, v) != napi_string) return false;
+      return js_utf8(env, v) == "line";
+    }
+
+    /*
+     * Image values are the ValueKey bytes of each distinct value; other
+     * values cannot be saved.
+     */
+    struct save_ctx_t {
+      IPTrie *iptrie;
+      std::vector<std::string> blobs;
+      std::map<std::string, uint32_t> numbers;
+      bool unsupported;
+    };
+
+    static uint32_t save_number(void *vctx, void *data) {
+      save_ctx_t *ctx = (save_ctx_t *)vctx;
+      IPTrie *iptrie = ctx->iptrie;
+      std::string blob;
+      if(!ValueKey(iptrie->env, iptrie->DataValue(data), blob)) {
+        ctx->unsupported = true;
+        return 0;
+      }
+      uint32_t &n = ctx->numbers[blob];
+      if(!n) {
+        ctx->blobs.push_back(blob);
+        n = ctx->blobs.size();
+      }
+      return n;
+    }
+
+    static const void *save_blob(void *vctx, uint32_t n, uint32_t *len) {
+      save_ctx_t *ctx = (save_ctx_t *)vctx;
+      *len = ctx->blobs[n-1].size();
+      return ctx->blobs[n-1].data();
+    }
+
+    /* values come out of a loaded image the first time they are found */
+    napi_value ImageValue(uint32_t n) {
+      uint32_t len;
+      const char *blob = (const char *)image_value(image, n, &len);
+      napi_value cached, v;
+      napi_get_reference_value(env, image_values, &cached);
+      v = js_at(env, cached, n);
+      if(js_typeof(env, v) != napi_undefined) return v;
+      switch(len ? blob[0] : 'z') {
+        case 's':
+          v = js_string(env, blob + 1, len - 1);
+          break;
+        case 'n': {
+          double d = 0;
+          if(len == 1 + sizeof(d)) memcpy(&d, blob + 1, sizeof(d));
+          v = js_number(env, d);
+          break;
+        }
+        case 't': v = js_bool(env, true); break;
+        case 'f': v = js_bool(env, false); break;
+        default: v = js_null(env); break;
+      }
+      js_set_at(env, cached, n, v);
+      return v;
+    }
+
+    /* throws and returns NULL when a value cannot go in an image */
+    void *BuildImage(size_t *len) {
+      save_ctx_t ctx;
+      btrie_image_values vals = { &ctx, save_number, save_blob };
+      ctx.iptrie = this;
+      ctx.unsupported = false;
+      void *img = build_image(&tree4, &tree6, &vals, len);
+      if(ctx.unsupported || !img) {
+        free(img);
+        js_throw_type(env, ctx.unsupported ?
+          "Only string, number, boolean and null values can be saved" :
+          "Out of memory building image");
+        return NULL;
+      }
+      return img;
+    }
+
+    /* A read-only IPTrie over an image.  Without an owner the image is a
+     * mapping the IPTrie unmaps; otherwise the owner holds the memory
+     * and is kept alive as long as the IPTrie. */
+    static napi_value ImageInstance(napi_env env, const void *img,
+                                    size_t len, napi_value owner) {
+      napi_value obj = NewInstance(env, 0, NULL);
+      IPTrie *iptrie;
+      if(!obj) return NULL;
+      napi_unwrap(env, obj, (void **)&iptrie);
+      iptrie->image = img;
+      iptrie->image_len = len;
+      napi_create_reference(env, js_array(env, image_nvalues(img) + 1), 1,
+                            &iptrie->image_values);
+      if(owner) napi_create_reference(env, owner, 1, &iptrie->image_owner);
+      return obj;
+    }
+
+    /* A subscriber moves to a newly published image between calls, and
+     * never while an async batch may still be reading the old one.  If
+     * the new image cannot be mapped the old one stays in service until
+     * the next generation. */
+    void Refresh() {
+      const void *img;
+      const char *err;
+      size_t len;
+      uint64_t g;
+      if(!published || !active.empty()) return;
+      if((g = read_generation(published)) == generation) return;
+      generation = g;
+      if((img = map_image(source.c_str(), &len, &err)) == NULL) return;
+      unmap_image(image, image_len);
+      image = img;
+      image_len = len;
+      napi_delete_reference(env, image_values);
+      napi_create_reference(env, js_array(env, image_nvalues(img) + 1), 1, &image_values);
+    }
+
+    uint32_t ImageFind(int family, const uint32_t *key) {
+      if(family==AF_INET) return find_image_ipv4_key(image, key[0], NULL);
+      return find_image_ipv6_key(image, key, NULL);
+    }
+
+    static bool ReadOnly(napi_env env, IPTrie *iptrie) {
+      const char *why = iptrie->image ? "IPTrie loaded from an image is read-only" :
+        iptrie->running ? "IPTrie cannot change during async lookups or a walk; use applyDiff" : NULL;
+      if(!why) return false;
+      js_throw(env, why);
+      return true;
+    }
+
+    napi_value ValueAt(uint32_t id) {
+      if(image) {
+        if(id == 0 || id > image_nvalues(image)) return js_undefined(env);
+        return ImageValue(id);
+      }
+      if(value_mode == VALUES_INTEGER)
+        return id && id <= 0x80000000 ? js_int(env, id - 1) : js_undefined(env);
+      if(id == 0 || id > batons.size() || !batons[id-1]) return js_undefined(env);
+      return js_at(env, Values(), id);
+    }
+
+
+    /*
+     * Readers that outlive a call: async batches and walks.  Each takes
+     * the current epoch when it starts.  add, del and addBulk throw while
+     * any reader is running; applyDiff instead changes the trees copy on
+     * write and files what it replaced (old nodes, deleted route data,
+     * stale compiled indexes) under the epoch it ran in, bumping the
+     * epoch.  Filed items are released once every reader that started in
+     * or before their epoch is done.  An async batch stops running when
+     * its lookups finish but is only done once its caller has seen the
+     * result, so that the values of routes deleted meanwhile still
+     * resolve.
+     */
+    struct retired_t {
+      uint64_t epoch;
+      btrie_retired *r4, *r6;
+      btrie_compiled *c4, *c6;
+    };
+
+    uint64_t ReaderStart() {
+      active.insert(epoch);
+      running++;
+      return epoch;
+    }
+
+    void ReaderStop() {
+      running--;
+    }
+
+    void ReaderDone(uint64_t e) {
+      active.erase(active.find(e));
+      while(!retiring.empty() &&
+            (active.empty() || *active.begin() > retiring.front().epoch)) {
+        Release(retiring.front());
+        retiring.erase(retiring.begin());
+      }
+    }
+
+    void Release(const retired_t &r) {
+      tree_release(&tree4, r.r4, DataFree());
+      tree_release(&tree6, r.r6, DataFree());
+      drop_compiled(r.c4);
+      drop_compiled(r.c6);
+    }
+
+    void Retire(btrie_retired *r4, btrie_retired *r6,
+                btrie_compiled *c4, btrie_compiled *c6) {
+      retired_t r = { epoch, r4, r6, c4, c6 };
+      if(active.empty()) Release(r);
+      else {
+        retiring.push_back(r);
+        epoch++;
+      }
+    }
+
+    /*
+     * Batch updates.  Every operation is parsed and checked before any is
+     * applied, so a bad entry leaves the trie as it was.  Deletes and then
+     * adds are applied in address order, so that consecutive operations
+     * walk the same, cache-warm upper levels of the trie.  With readers
+     * active the changes are made copy on write and retired afterwards.
+     */
+    struct diff_op_t {
+      int family, prefix_len;
+      uint32_t key[4];
+      void *data;
+      bool operator<(const diff_op_t &o) const {
+        int i;
+        if(family != o.family) return family < o.family;
+        for(i=0;i<4;i++)
+          if(key[i] != o.key[i]) return key[i] < o.key[i];
+        return prefix_len < o.prefix_len;
+      }
+    };
+
+    void ApplyDiff(std::vector<diff_op_t> &adds, std::vector<diff_op_t> &dels,
+                   int *added, int *deleted) {
+      bool cow = !active.empty(), touched4 = false, touched6 = false;
+      size_t i;
+
+      /* stable, so that the last of several adds of a prefix wins */
+      std::stable_sort(adds.begin(), adds.end());
+      std::sort(dels.begin(), dels.end());
+      if(cow) {
+        tree_begin(&tree4);
+        tree_begin(&tree6);
+      }
+      *deleted = 0;
+      for(i=0;i<dels.size();i++) {
+        diff_op_t &op = dels[i];
+        if(op.family == AF_INET)
+          *deleted += del_route_ipv4_key(&tree4, op.key[0], op.prefix_len, DataFree());
+        else
+          *deleted += del_route_ipv6_key(&tree6, op.key, op.prefix_len, DataFree());
+      }
+      for(i=0;i<adds.size();i++) {
+        diff_op_t &op = adds[i];
+        if(op.family == AF_INET)
+          add_route_ipv4_key(&tree4, op.key[0], op.prefix_len, op.data, DataFree());
+        else
+          add_route_ipv6_key(&tree6, op.key, op.prefix_len, op.data, DataFree());
+      }
+      *added = adds.size();
+      ops.add += *added;
+      ops.del += *deleted;
+      for(i=0;i<adds.size() + dels.size();i++) {
+        int family = i < adds.size() ? adds[i].family : dels[i - adds.size()].family;
+        if(family == AF_INET) touched4 = true;
+        else touched6 = true;
+      }
+      if(cow) Retire(tree_commit(&tree4), tree_commit(&tree6), NULL, NULL);
+      if(touched4) Invalidate(AF_INET);
+      if(touched6) Invalidate(AF_INET6);
+    }
+
+    /* [address, prefix_length] or, for an add, [address, prefix_length, value] */
+    static bool DiffOp(napi_env env, napi_value entry, bool add, diff_op_t &op) {
+      if(!js_is_array(env, entry)) return false;
+      napi_value address = js_at(env, entry, 0), len = js_at(env, entry, 1);
+      if(js_length(env, entry) < (add ? 3u : 2u) || !IsAddress(env, address) ||
+         !js_is_uint32(env, len))
+        return false;
+      memset(op.key, 0, sizeof(op.key));
+      op.family = AddressArg(env, address, op.key);
+      op.prefix_len = js_uint32(env, len);
+      op.data = NULL;
+      return op.family != 0 && op.prefix_len <= (op.family == AF_INET ? 32 : 128);
+    }
+
+    /*
+     * Async lookups.  A batch is split into chunks of ASYNC_CHUNK
+     * addresses that run on the libuv threadpool and write value indices
+     * straight into the result Uint32Array.  Each batch looks up in a
+     * snapshot taken when it was queued: the roots of both trees (not the
+     * DIR-24-8 index or prefilter, which are updated in place) and any
+     * compiled index that is current.  The read paths touch nothing else,
+     * so they need no locking.
+     */
+    static const size_t ASYNC_CHUNK = 8192;
+    struct async_batch_t {
+      IPTrie *iptrie;
+      uint64_t epoch;
+      btrie4 tree4;
+      btrie6 tree6;
+      btrie_compiled *compiled4, *compiled6;
+      int family, pending;
+      std::vector<uint32_t> keys;
+      /* byte counts for the counters, if given */
+      std::vector<uint32_t> lengths;
+      uint32_t *out;
+      napi_ref result;
+      napi_ref callback;
+      napi_deferred deferred;
+      napi_ref promise;
+    };
+    struct async_chunk_t {
+      napi_async_work work;
+      async_batch_t *batch;
+      size_t start, count;
+    };
+
+    /* what a promise's last reaction releases */
+    struct async_release_t {
+      IPTrie *iptrie;
+      uint64_t epoch;
+      async_release_t(IPTrie *iptrie, uint64_t epoch) : iptrie(iptrie), epoch(epoch) {}
+    };
+
+    static void AsyncWork(napi_env env, void *data) {
+      async_chunk_t *chunk = (async_chunk_t *)data;
+      async_batch_t *batch = chunk->batch;
+      IPTrie *iptrie = batch->iptrie;
+      int width = batch->family == AF_INET ? 1 : 4;
+      const uint32_t *keys = chunk->count ? &batch->keys[chunk->start * width] : NULL;
+      uint32_t *out = batch->out + chunk->start;
+      size_t i, n = chunk->count;
+
+      /* value indices: 1 upward for a match, 0 for none */
+      if(iptrie->image) {
+        for(i=0;i<n;i++) out[i] = iptrie->ImageFind(batch->family, keys + i*width);
+        return;
+      }
+      std::vector<void *> found(n);
+      btrie_compiled *c = batch->family == AF_INET ? batch->compiled4 : batch->compiled6;
+      if(n == 0) return;
+      if(c) {
+        for(i=0;i<n;i++) {
+          if(batch->family == AF_INET) found[i] = find_compiled_ipv4_key(c, keys[i], NULL);
+          else found[i] = find_compiled_ipv6_key(c, keys + i*4, NULL);
+        }
+      }
+      else if(batch->family == AF_INET)
+        find_bpm_route_ipv4_many(&batch->tree4, keys, n, &found[0]);
+      else
+        find_bpm_route_ipv6_many(&batch->tree6, keys, n, &found[0]);
+      for(i=0;i<n;i++) out[i] = iptrie->DataId(found[i]);
+      if(iptrie->counting) {
+        const uint32_t *lengths = batch->lengths.empty() ? NULL :
+                                  &batch->lengths[chunk->start];
+        for(i=0;i<n;i++) iptrie->Count(found[i], lengths ? lengths[i] : 0);
+      }
+    }
+
+    static void AsyncDone(napi_env env, napi_status status, void *data) {
+      async_chunk_t *chunk = (async_chunk_t *)data;
+      async_batch_t *batch = chunk->batch;
+      napi_delete_async_work(env, chunk->work);
+      delete chunk;
+      if(--batch->pending > 0) return;
+
+      IPTrie *iptrie = batch->iptrie;
+      iptrie->ReaderStop();
+      napi_value result, self;
+      size_t i, n = batch->keys.size() / (batch->family == AF_INET ? 1 : 4), hits = 0;
+      napi_get_reference_value(env, batch->result, &result);
+      for(i=0;i<n;i++) hits += batch->out[i] != 0;
+      iptrie->CountFinds(n, hits);
+      /* the indices must resolve with value() wherever the caller first
+       * sees them, so the snapshot lasts until after the callback, or
+       * until the reactions already waiting on the promise have run */
+      if(batch->callback) {
+        napi_value cb, rv, argv[2] = { js_null(env), result };
+        napi_get_reference_value(env, batch->callback, &cb);
+        napi_get_reference_value(env, iptrie->self, &self);
+        napi_call_function(env, self, cb, 2, argv, &rv);
+        napi_delete_reference(env, batch->callback);
+        iptrie->ReaderDone(batch->epoch);
+        iptrie->Unref();
+      }
+      else {
+        napi_value promise, then, release, rv;
+        napi_resolve_deferred(env, batch->deferred, result);
+        napi_get_reference_value(env, batch->promise, &promise);
+        napi_delete_reference(env, batch->promise);
+        napi_create_function(env, "release", NAPI_AUTO_LENGTH, AsyncRelease,
+                             new async_release_t(iptrie, batch->epoch), &release);
+        then = js_get(env, promise, "then");
+        napi_call_function(env, promise, then, 1, &release, &rv);
+      }
+      napi_delete_reference(env, batch->result);
+      delete batch;
+    }
+
+    static napi_value AsyncRelease(napi_env env, napi_callback_info info) {
+      void *data;
+      napi_get_cb_info(env, info, NULL, NULL, NULL, &data);
+      async_release_t *r = (async_release_t *)data;
+      r->iptrie->ReaderDone(r->epoch);
+      r->iptrie->Unref();
+      delete r;
+      return NULL;
+    }
+
+    void Ref() {
+      napi_reference_ref(env, self, NULL);
+    }
+    void Unref() {
+      napi_reference_unref(env, self, NULL);
+    }
+
+    static napi_value FormatAddress(napi_env env, int family, const uint32_t *key) {
+      uint32_t nw[4];
+      char ip[INET6_ADDRSTRLEN];
+      int i;
+      for(i=0;i<(family == AF_INET ? 1 : 4);i++) nw[i] = htonl(key[i]);
+      inet_ntop(family, nw, ip, sizeof(ip));
+      return js_string(env, ip);
+    }
+
+    /* { prefix, length, value } as findAll and walk report a route */
+    napi_value RouteObject(int family, const uint32_t *key, int prefix_len, void *data) {
+      napi_value obj = js_object(env);
+      js_set(env, obj, "prefix", FormatAddress(env, family, key));
+      js_set(env, obj, "length", js_int(env, prefix_len));
+      js_set(env, obj, "value", DataValue(data));
+      return obj;
+    }
+
+    struct walk_ctx_t {
+      napi_env env;
+      IPTrie *iptrie;
+      int family;
+      napi_value cb;
+      bool threw;
+    };
+
+    /* stops on an exception, left pending, or when the callback returns false */
+    static int walk_route(void *vctx, const uint32_t *key,
+                          unsigned char prefix_len, void *data) {
+      walk_ctx_t *ctx = (walk_ctx_t *)vctx;
+      napi_env env = ctx->env;
+      napi_handle_scope scope;
+      napi_value global, rv, argv[3];
+      int stop;
+      napi_open_handle_scope(env, &scope);
+      napi_get_global(env, &global);
+      argv[0] = FormatAddress(env, ctx->family, key);
+      argv[1] = js_int(env, prefix_len);
+      argv[2] = ctx->iptrie->DataValue(data);
+      if(napi_call_function(env, global, ctx->cb, 3, argv, &rv) != napi_ok) {
+        ctx->threw = true;
+        stop = 1;
+      }
+      else {
+        bool b;
+        stop = js_typeof(env, rv) == napi_boolean &&
+               napi_get_value_bool(env, rv, &b) == napi_ok && !b;
+      }
+      napi_close_handle_scope(env, scope);
+      return stop;
+    }
+
+    static int ParseAddress(const char *ip, uint32_t *key) {
       union {
         struct in_addr addr4;
         struct in6_addr addr6;
       } a;
+      int i;
+
+      /* only IPv6 has colons; spare it the IPv4 attempt */
+      if(!strchr(ip, ':') && inet_pton(AF_INET, ip, &a) == 1) {
+        key[0] = ntohl(a.addr4.s_addr);
+        return AF_INET;
+      }
+      if(inet_pton(AF_INET6, ip, &a) == 1) {
+        memcpy(key, &a.addr6.s6_addr, 16);
+        for(i=0;i<4;i++) key[i] = ntohl(key[i]);
+        return AF_INET6;
+      }
+      return 0;
+    }
+
+    /* An address argument is a string, an IPv4 address as a number or a
+     * Buffer holding a 4 or 16 byte network order address.  The binary
+     * forms skip inet_pton entirely. */
+    /* numbers must be exact uint32s: -1 or 1.5 are not addresses */
+    static bool IsAddress(napi_env env, napi_value arg) {
+      return js_typeof(env, arg) == napi_string || js_is_uint32(env, arg) ||
+             js_is_buffer(env, arg);
+    }
+    static int AddressArg(napi_env env, napi_value arg, uint32_t *key) {
+      if(js_typeof(env, arg) == napi_number) {
+        key[0] = js_uint32(env, arg);
+        return AF_INET;
+      }
+      if(js_is_buffer(env, arg)) {
+        void *bytes;
+        size_t i, len;
+        napi_get_buffer_info(env, arg, &bytes, &len);
+        if(len != 4 && len != 16) return 0;
+        memcpy(key, bytes, len);
+        for(i=0;i<len/4;i++) key[i] = ntohl(key[i]);
+        return len == 4 ? AF_INET : AF_INET6;
+      }
+      return ParseAddress(js_utf8(env, arg).c_str(), key);
+    }
+
+  protected:
+    static napi_value New(napi_env env, napi_callback_info info) {
+      size_t argc = 1;
+      napi_value argv[1], jsthis;
+      napi_get_cb_info(env, info, &argc, argv, &jsthis, NULL);
+      IPTrie *iptrie = new IPTrie(env);
+      napi_value values = js_array(env, 0);
+      if(napi_wrap(env, jsthis, iptrie, Finalize, NULL, &iptrie->self) != napi_ok) {
+        delete iptrie;
+        return NULL;
+      }
+      napi_create_reference(env, values, 1, &iptrie->values);
+
+      if (argc > 0 && js_typeof(env, argv[0]) == napi_object) {
+        napi_value opts = argv[0];
+        if (js_truthy(env, js_get(env, opts, "dir24")))
+          enable_dir24(&iptrie->tree4);
+        if (js_truthy(env, js_get(env, opts, "prefilter"))) {
+          enable_prefilter(&iptrie->tree4);
+          enable_prefilter(&iptrie->tree6);
+        }
+        napi_value mode = js_get(env, opts, "valueMode");
+        if (js_typeof(env, mode) == napi_string) {
+          std::string name = js_utf8(env, mode);
+          if (name == "integer") iptrie->value_mode = VALUES_INTEGER;
+          else if (name == "intern") iptrie->value_mode = VALUES_INTERN;
+          else if (name == "lists") iptrie->value_mode = VALUES_LISTS;
+          else if (name != "object") {
+            js_throw_type(env, "valueMode must be object, intern, integer or lists");
+            return NULL;
+          }
+        }
+        iptrie->precompute = iptrie->value_mode == VALUES_LISTS &&
+                             js_truthy(env, js_get(env, opts, "precompute"));
+        if (js_truthy(env, js_get(env, opts, "counters"))) {
+          if (iptrie->value_mode == VALUES_LISTS) {
+            js_throw_type(env, "counters are not available in lists mode");
+            return NULL;
+          }
+          iptrie->counting = true;
+        }
+        napi_value cache = js_get(env, opts, "cache");
+        if (js_is_uint32(env, cache) && js_uint32(env, cache) > 0)
+          iptrie->EnableCache(js_uint32(env, cache));
+      }
+
+      return jsthis;
+    }
+
+    static napi_value Add(napi_env env, napi_callback_info info) {
+      size_t argc = 3;
+      napi_value argv[3];
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      if(!iptrie) return NULL;
+
+      if (argc < 1 || !IsAddress(env, argv[0])) {
+        js_throw_type(env, "First argument must be an IP.");
+        return NULL;
+      }
+      if (argc < 2 || js_typeof(env, argv[1]) != napi_number){
+        js_throw_type(env, "Second argument must be a prefix length");
+        return NULL;
+      }
+      if (argc < 3) {
+        js_throw_type(env, "Third argument must exist");
+        return NULL;
+      }
+
+      uint32_t key[4];
+      int family = AddressArg(env, argv[0], key);
+      int prefix_len = js_uint32(env, argv[1]);
 
-      family = AF_INET;
-      rv = inet_pton(family, query, &a);
-      if(rv != 1) {
-        family = AF_INET6;
-        rv = inet_pton(family, query, &a);
-        if(rv != 1) {
+      if(family == 0) {
+        js_throw_type(env, "Could not parse IP");
+        return NULL;
+      }
+      if(prefix_len > (family == AF_INET ? 32 : 128)) {
+        js_throw_type(env, "Prefix length out of range");
+        return NULL;
+      }
+
+      if(ReadOnly(env, iptrie)) return NULL;
+      if(iptrie->value_mode == VALUES_LISTS) {
+        int list = ListArg(env, argv[2]);
+        if(list >= 0) iptrie->AddList(family, key, prefix_len, list);
+        return NULL;
+      }
+      iptrie->Add(family, key, prefix_len, argv[2]);
+      return NULL;
+    }
+
+    /* a list id from 0 to 63, or -1 having thrown */
+    static int ListArg(napi_env env, napi_value v) {
+      if(js_is_uint32(env, v) && js_uint32(env, v) < 64) return js_uint32(env, v);
+      js_throw_type(env, "List must be an integer from 0 to 63");
+      return -1;
+    }
+
+    /* true having thrown when the trie is in lists mode */
+    static bool ListsMode(napi_env env, IPTrie *iptrie, const char *what) {
+      if(iptrie->value_mode != VALUES_LISTS) return false;
+      js_throw(env, (std::string(what) + " is not available in lists mode").c_str());
+      return true;
+    }
+
+    static napi_value Del(napi_env env, napi_callback_info info) {
+      size_t argc = 3;
+      napi_value argv[3];
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      if(!iptrie) return NULL;
+
+      if (argc < 1 || !IsAddress(env, argv[0])) {
+        js_throw_type(env, "First argument must be an IP.");
+        return NULL;
+      }
+      if (argc < 2 || js_typeof(env, argv[1]) != napi_number){
+        js_throw_type(env, "Second argument must be a prefix length");
+        return NULL;
+      }
+
+      uint32_t key[4];
+      int family = AddressArg(env, argv[0], key);
+      int prefix_len = js_uint32(env, argv[1]);
+
+      if(ReadOnly(env, iptrie)) return NULL;
+      if(iptrie->value_mode == VALUES_LISTS) {
+        int list = -1;
+        if(argc > 2 && js_typeof(env, argv[2]) != napi_undefined &&
+           (list = ListArg(env, argv[2])) < 0)
           return NULL;
+        return js_bool(env, family != 0 &&
+                       prefix_len <= (family == AF_INET ? 32 : 128) &&
+                       iptrie->DelList(family, key, prefix_len, list));
+      }
+      int success = family != 0 &&
+        prefix_len <= (family == AF_INET ? 32 : 128) &&
+        iptrie->Del(family, key, prefix_len);
+
+      return js_bool(env, success);
+    }
+
+    /* the key of find's or has' address argument; 0 when it does not
+     * parse, -1 having thrown */
+    static int FindArg(napi_env env, size_t argc, napi_value *argv, uint32_t *key) {
+      if (argc < 1 || !IsAddress(env, argv[0])) {
+        js_throw_type(env, "Required argument: ip address.");
+        return -1;
+      }
+      return AddressArg(env, argv[0], key);
+    }
+
+    /* the byte count find and has may take for the counters */
+    static uint64_t BytesArg(napi_env env, size_t argc, napi_value *argv, size_t i) {
+      if(argc <= i || js_typeof(env, argv[i]) != napi_number) return 0;
+      double d = js_double(env, argv[i]);
+      return d > 0 ? (uint64_t)d : 0;
+    }
+
+    static napi_value Find(napi_env env, napi_callback_info info) {
+      size_t argc = 2;
+      napi_value argv[2];
+      uint32_t key[4];
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      if(!iptrie) return NULL;
+      int family = FindArg(env, argc, argv, key);
+      if(family <= 0) return NULL;
+
+      iptrie->Refresh();
+      if(iptrie->image) {
+        uint32_t n = iptrie->ImageFind(family, key);
+        iptrie->CountFinds(1, n != 0);
+        return n ? iptrie->ImageValue(n) : NULL;
+      }
+      void *d = iptrie->Find(family, key);
+      iptrie->CountFinds(1, d != NULL);
+      iptrie->Count(d, BytesArg(env, argc, argv, 1));
+      return d ? iptrie->DataValue(d) : NULL;
+    }
+
+    /* find without making the value: true when any route matches */
+    static napi_value Has(napi_env env, napi_callback_info info) {
+      size_t argc = 2;
+      napi_value argv[2];
+      uint32_t key[4];
+      bool hit;
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      if(!iptrie) return NULL;
+      int family = FindArg(env, argc, argv, key);
+      if(family < 0) return NULL;
+      if(family == 0) return js_bool(env, false);
+
+      iptrie->Refresh();
+      if(iptrie->image) hit = iptrie->ImageFind(family, key) != 0;
+      else {
+        void *d = iptrie->Find(family, key);
+        iptrie->Count(d, BytesArg(env, argc, argv, 1));
+        hit = d != NULL;
+      }
+      iptrie->CountFinds(1, hit);
+      return js_bool(env, hit);
+    }
+
+    /* the lists an address is in, as a BigInt bitmask */
+    static napi_value Classify(napi_env env, napi_callback_info info) {
+      size_t argc = 1;
+      napi_value argv[1];
+      uint32_t key[4];
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      if(!iptrie) return NULL;
+      int family = FindArg(env, argc, argv, key);
+      if(family < 0) return NULL;
+      if(iptrie->value_mode != VALUES_LISTS) {
+        js_throw(env, "classify needs valueMode lists");
+        return NULL;
+      }
+      if(family == 0) return js_bigint(env, 0);
+      return js_bigint(env, iptrie->Classify(family, key));
+    }
+
+    /*
+     * A Uint32Array of IPv4 addresses as numbers, or packed network order
+     * addresses in any other ArrayBufferView: IPv4 unless the second
+     * argument is 6.  Returns the number of addresses, or -1 having
+     * thrown.
+     */
+    static int PackedArg(napi_env env, size_t argc, napi_value *argv,
+                         std::vector<uint32_t> &keys, int *family) {
+      napi_typedarray_type type = napi_uint8_array;
+      size_t n;
+      void *p;
+      char *data;
+      int i;
+      if (napi_get_typedarray_info(env, argv[0], &type, &n, &p, NULL, NULL) == napi_ok &&
+          type == napi_uint32_array) {
+        const uint32_t *words = (const uint32_t *)p;
+        keys.assign(words, words + n);
+        *family = AF_INET;
+        return keys.size();
+      }
+      size_t len;
+      js_bytes(env, argv[0], &data, &len);
+      const unsigned char *bytes = (const unsigned char *)data;
+      int v6 = argc > 1 && js_typeof(env, argv[1]) == napi_number &&
+               js_uint32(env, argv[1]) == 6;
+      size_t width = v6 ? 16 : 4;
+      if (len % width) {
+        js_throw_type(env, "Buffer length must be a multiple of the address size");
+        return -1;
+      }
+      keys.resize(len / 4);
+      for(i=0;i<(int)(len/4);i++) {
+        uint32_t nw;
+        memcpy(&nw, bytes + i*4, 4);
+        keys[i] = ntohl(nw);
+      }
+      *family = v6 ? AF_INET6 : AF_INET;
+      return len / width;
+    }
+
+    /*
+     * The byte counts findMany and findManyAsync may take after the
+     * addresses for the counters: a Uint32Array with one per address.
+     * Returns false having thrown.
+     */
+    static bool LengthsArg(napi_env env, size_t argc, napi_value *argv, size_t n,
+                           const uint32_t **lengths) {
+      napi_typedarray_type type;
+      size_t i, len;
+      void *p;
+      *lengths = NULL;
+      for(i=1;i<argc;i++) {
+        if(!js_is_view(env, argv[i])) continue;
+        if(napi_get_typedarray_info(env, argv[i], &type, &len, &p, NULL, NULL) != napi_ok ||
+           type != napi_uint32_array || len != n) {
+          js_throw_type(env, "Byte counts must be a Uint32Array with one per address");
+          return false;
         }
+        *lengths = (const uint32_t *)p;
       }
-      if(family==AF_INET) return (obj_baton_t *)find_bpm_route_ipv4(&tree4, &a.addr4, &pl);
-      else return (obj_baton_t *)find_bpm_route_ipv6(&tree6, &a.addr6, &pl);
+      return true;
     }
 
-  protected:
-    static void New(const FunctionCallbackInfo<Value> &args) {
-      IPTrie *iptrie = new IPTrie();
-      iptrie->Wrap(args.This());
+    static napi_value FindMany(napi_env env, napi_callback_info info) {
+      size_t argc = 3;
+      napi_value argv[3];
+      const uint32_t *lengths;
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      std::vector<uint32_t> keys4, keys6;
+      std::vector<int> slot4, slot6;
+      int i, n;
+      if(!iptrie) return NULL;
+
+      if (argc > 0 && js_is_array(env, argv[0])) {
+        n = js_length(env, argv[0]);
+        for(i=0;i<n;i++) {
+          uint32_t key[4];
+          napi_value v = js_at(env, argv[0], i);
+          if(!IsAddress(env, v)) continue;
+          switch(AddressArg(env, v, key)) {
+            case AF_INET:
+              keys4.push_back(key[0]);
+              slot4.push_back(i);
+              break;
+            case AF_INET6:
+              keys6.insert(keys6.end(), key, key + 4);
+              slot6.push_back(i);
+              break;
+          }
+        }
+      }
+      else if (argc > 0 && js_is_view(env, argv[0])) {
+        int family;
+        std::vector<uint32_t> keys;
+        if((n = PackedArg(env, argc, argv, keys, &family)) < 0) return NULL;
+        std::vector<uint32_t> &fkeys = family == AF_INET ? keys4 : keys6;
+        std::vector<int> &slot = family == AF_INET ? slot4 : slot6;
+        fkeys.swap(keys);
+        for(i=0;i<n;i++) slot.push_back(i);
+      }
+      else {
+        js_throw_type(env, "Required argument: array of ip addresses or packed buffer.");
+        return NULL;
+      }
 
-      args.GetReturnValue().Set(args.This());
+      if(!LengthsArg(env, argc, argv, n, &lengths)) return NULL;
+
+      napi_value result = js_array(env, n);
+      for(i=0;i<n;i++) js_set_at(env, result, i, js_null(env));
+      size_t hits = 0;
+      iptrie->Refresh();
+      if(iptrie->image) {
+        for(i=0;i<(int)slot4.size();i++) {
+          uint32_t v = iptrie->ImageFind(AF_INET, &keys4[i]);
+          if(v) js_set_at(env, result, slot4[i], iptrie->ImageValue(v)), hits++;
+        }
+        for(i=0;i<(int)slot6.size();i++) {
+          uint32_t v = iptrie->ImageFind(AF_INET6, &keys6[i*4]);
+          if(v) js_set_at(env, result, slot6[i], iptrie->ImageValue(v)), hits++;
+        }
+        iptrie->CountFinds(slot4.size() + slot6.size(), hits);
+        return result;
+      }
+      std::vector<void *> out4(slot4.size()), out6(slot6.size());
+      if(!slot4.empty())
+        iptrie->FindMany(AF_INET, &keys4[0], slot4.size(), &out4[0]);
+      if(!slot6.empty())
+        iptrie->FindMany(AF_INET6, &keys6[0], slot6.size(), &out6[0]);
+      for(i=0;i<(int)slot4.size();i++) {
+        if(!out4[i]) continue;
+        iptrie->Count(out4[i], lengths ? lengths[slot4[i]] : 0);
+        js_set_at(env, result, slot4[i], iptrie->DataValue(out4[i]));
+        hits++;
+      }
+      for(i=0;i<(int)slot6.size();i++) {
+        if(!out6[i]) continue;
+        iptrie->Count(out6[i], lengths ? lengths[slot6[i]] : 0);
+        js_set_at(env, result, slot6[i], iptrie->DataValue(out6[i]));
+        hits++;
+      }
+      iptrie->CountFinds(slot4.size() + slot6.size(), hits);
+      return result;
     }
 
-    static void Add(const FunctionCallbackInfo<Value> &args) {
-      Isolate *isolate = args.GetIsolate();
-      HandleScope scope(isolate);
+    static napi_value Compile(napi_env env, napi_callback_info info) {
+      IPTrie *iptrie = Unwrap(env, info, NULL, NULL);
+      if(iptrie) iptrie->Compile();
+      return NULL;
+    }
 
-      if (args.Length() < 1 || !args[0]->IsString()) {
-        isolate->ThrowException(
-                Exception::TypeError(
-                    String::NewFromUtf8(isolate, "First argument must be an IP.")));
-        return;
+    /* objects are the same value only if they are the same object */
+    static int SameData(void *ctx, void *a, void *b) {
+      IPTrie *iptrie = (IPTrie *)ctx;
+      bool same = false;
+      a = iptrie->Inner(a);
+      b = iptrie->Inner(b);
+      if(a == b) return 1;
+      if(iptrie->value_mode != VALUES_OBJECT) return 0;
+      napi_strict_equals(iptrie->env, iptrie->DataValue(a), iptrie->DataValue(b), &same);
+      return same;
+    }
+
+    size_t NodesUsed() {
+      btrie_alloc_stats st4, st6;
+      tree_alloc_stats(&tree4, &st4);
+      tree_alloc_stats(&tree6, &st6);
+      return st4.nodes_used + st6.nodes_used;
+    }
+
+    static napi_value Optimize(napi_env env, napi_callback_info info) {
+      IPTrie *iptrie = Unwrap(env, info, NULL, NULL);
+      if(!iptrie || ReadOnly(env, iptrie) || ListsMode(env, iptrie, "optimize")) return NULL;
+
+      size_t before = iptrie->NodesUsed(), removed4, removed6;
+      removed4 = optimize_tree(&iptrie->tree4, SameData, iptrie, iptrie->DataFree());
+      removed6 = optimize_tree(&iptrie->tree6, SameData, iptrie, iptrie->DataFree());
+      if(removed4) iptrie->Invalidate(AF_INET);
+      if(removed6) iptrie->Invalidate(AF_INET6);
+
+      napi_value nodes = js_object(env);
+      js_set(env, nodes, "before", js_number(env, before));
+      js_set(env, nodes, "after", js_number(env, iptrie->NodesUsed()));
+      napi_value result = js_object(env);
+      js_set(env, result, "removed", js_number(env, removed4 + removed6));
+      js_set(env, result, "nodes", nodes);
+      return result;
+    }
+
+    size_t NodeBytes() {
+      btrie_alloc_stats st4, st6;
+      tree_alloc_stats(&tree4, &st4);
+      tree_alloc_stats(&tree6, &st6);
+      return st4.bytes + st6.bytes;
+    }
+
+    /* relays the nodes out in lookup order, typically after churn */
+    static napi_value Compact(napi_env env, napi_callback_info info) {
+      IPTrie *iptrie = Unwrap(env, info, NULL, NULL);
+      if(!iptrie || ReadOnly(env, iptrie)) return NULL;
+      /* nodes applyDiff replaced must go back to the slabs they came from */
+      if(!iptrie->retiring.empty()) {
+        js_throw(env, "IPTrie cannot compact until pending async results are delivered");
+        return NULL;
       }
-      if (args.Length() < 2 || !args[1]->IsNumber()){
-        isolate->ThrowException(
-          Exception::TypeError(
-            String::NewFromUtf8(isolate, "Second argument must be a prefix length")));
-        return;
+
+      size_t before = iptrie->NodeBytes();
+      compact_tree(&iptrie->tree4);
+      compact_tree(&iptrie->tree6);
+
+      napi_value result = js_object(env);
+      js_set(env, result, "before", js_number(env, before));
+      js_set(env, result, "after", js_number(env, iptrie->NodeBytes()));
+      return result;
+    }
+
+    template <int W>
+    static napi_value AllocStatsObject(napi_env env, btrie_tree<W> *tree) {
+      btrie_alloc_stats st;
+      napi_value obj = js_object(env);
+      tree_alloc_stats(tree, &st);
+      js_set(env, obj, "slabs", js_number(env, st.slabs));
+      js_set(env, obj, "nodes", js_number(env, st.nodes_used));
+      js_set(env, obj, "free", js_number(env, st.nodes_free));
+      js_set(env, obj, "nodeSize", js_number(env, st.node_size));
+      js_set(env, obj, "bytes", js_number(env, st.bytes));
+      return obj;
+    }
+
+    template <int W>
+    static napi_value ShapeStatsObject(napi_env env, btrie_tree<W> *tree) {
+      btrie_shape_stats shape;
+      btrie_alloc_stats st;
+      napi_value obj = js_object(env);
+      int i;
+      tree_shape_stats(tree, &shape);
+      tree_alloc_stats(tree, &st);
+      napi_value depth = js_array(env, shape.nodes ? shape.max_depth + 1 : 0);
+      for(i=0;shape.nodes && i<=shape.max_depth;i++)
+        js_set_at(env, depth, i, js_number(env, shape.depth[i]));
+      js_set(env, obj, "nodes", js_number(env, shape.nodes));
+      js_set(env, obj, "routes", js_number(env, shape.routes));
+      js_set(env, obj, "incidental", js_number(env, shape.incidental));
+      js_set(env, obj, "depth", depth);
+      js_set(env, obj, "avgPath", js_number(env, shape.avg_path));
+      js_set(env, obj, "maxPath", js_number(env, shape.nodes ? shape.max_depth + 1 : 0));
+      js_set(env, obj, "bytes", js_number(env, st.bytes + shape.dir_bytes));
+      return obj;
+    }
+
+    static napi_value Stats(napi_env env, napi_callback_info info) {
+      IPTrie *iptrie = Unwrap(env, info, NULL, NULL);
+      if(!iptrie) return NULL;
+      napi_value result = js_object(env);
+      napi_value ops = js_object(env);
+      js_set(env, result, "ipv4", ShapeStatsObject(env, &iptrie->tree4));
+      js_set(env, result, "ipv6", ShapeStatsObject(env, &iptrie->tree6));
+      js_set(env, ops, "add", js_number(env, iptrie->ops.add));
+      js_set(env, ops, "del", js_number(env, iptrie->ops.del));
+      js_set(env, ops, "find", js_number(env, iptrie->ops.find));
+      js_set(env, ops, "hit", js_number(env, iptrie->ops.hit));
+      js_set(env, ops, "miss", js_number(env, iptrie->ops.miss));
+      js_set(env, result, "counters", ops);
+      return result;
+    }
+
+    static napi_value CacheStats(napi_env env, napi_callback_info info) {
+      IPTrie *iptrie = Unwrap(env, info, NULL, NULL);
+      if(!iptrie) return NULL;
+      napi_value result = js_object(env);
+      uint32_t entries = iptrie->cache ? (iptrie->cache_mask + 1) * CACHE_WAYS : 0;
+      js_set(env, result, "entries", js_number(env, entries));
+      js_set(env, result, "hits", js_number(env, iptrie->cache_hits));
+      js_set(env, result, "misses", js_number(env, iptrie->cache_misses));
+      return result;
+    }
+
+    static napi_value AllocStats(napi_env env, napi_callback_info info) {
+      IPTrie *iptrie = Unwrap(env, info, NULL, NULL);
+      if(!iptrie) return NULL;
+      napi_value result = js_object(env);
+      js_set(env, result, "ipv4", AllocStatsObject(env, &iptrie->tree4));
+      js_set(env, result, "ipv6", AllocStatsObject(env, &iptrie->tree6));
+      return result;
+    }
+
+    static napi_value Save(napi_env env, napi_callback_info info) {
+      size_t argc = 1;
+      napi_value argv[1];
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      if(!iptrie) return NULL;
+
+      if (argc < 1 || js_typeof(env, argv[0]) != napi_string) {
+        js_throw_type(env, "Required argument: path.");
+        return NULL;
       }
-      if (args.Length() < 3) {
-        isolate->ThrowException(
-          Exception::TypeError(
-            String::NewFromUtf8(isolate, "Third argument must exist")));
-        return;
+      std::string path = js_utf8(env, argv[0]);
+
+      void *img = NULL;
+      const void *out = iptrie->image;
+      size_t len = iptrie->image_len;
+      if(!out && (out = img = iptrie->BuildImage(&len)) == NULL) return NULL;
+      int rv = write_image(path.c_str(), out, len);
+      int err = errno;
+      free(img);
+      if(rv < 0) js_throw_errno(env, err, "save", path.c_str());
+      return NULL;
+    }
+
+    static napi_value Freeze(napi_env env, napi_callback_info info) {
+      IPTrie *iptrie = Unwrap(env, info, NULL, NULL);
+      if(!iptrie) return NULL;
+      void *img = NULL;
+      const void *out = iptrie->image;
+      size_t len = iptrie->image_len;
+      if(!out && (out = img = iptrie->BuildImage(&len)) == NULL) return NULL;
+      napi_value sab, size = js_number(env, len);
+      char *data;
+      size_t sab_len;
+      if(napi_new_instance(env, js_global(env, "SharedArrayBuffer"), 1, &size, &sab) != napi_ok ||
+         !js_bytes(env, sab, &data, &sab_len)) {
+        free(img);
+        return NULL;
       }
+      memcpy(data, out, len);
+      free(img);
+      return sab;
+    }
 
-      String::Utf8Value ipaddress(args[0]->ToString());
-      int prefix_len = args[1]->ToUint32()->Value();
+    static napi_value FromShared(napi_env env, napi_callback_info info) {
+      size_t argc = 1;
+      napi_value argv[1];
+      char *data = NULL;
+      size_t len = 0;
+      napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
 
-      IPTrie *iptrie = ObjectWrap::Unwrap<IPTrie>(args.This());
-      Handle<Value> data = args[2];
-      if(iptrie->Add(*ipaddress, prefix_len, data) == 0) {
-        isolate->ThrowException(
-          Exception::TypeError(
-            String::NewFromUtf8(isolate, "Could not parse IP")));
-        return;
+      if (argc < 1 || js_typeof(env, argv[0]) != napi_object ||
+          !js_bytes(env, argv[0], &data, &len)) {
+        js_throw_type(env, "Required argument: SharedArrayBuffer or Buffer holding an image.");
+        return NULL;
+      }
+      const char *err = ((uintptr_t)data & 7) ?
+        "image must be 8 byte aligned" : check_image(data, len);
+      if(err) {
+        js_throw(env, err);
+        return NULL;
       }
+      return ImageInstance(env, data, len, argv[0]);
     }
 
-    static void Del(const FunctionCallbackInfo<Value> &args) {
-      Isolate *isolate = args.GetIsolate();
+    static napi_value Load(napi_env env, napi_callback_info info) {
+      size_t argc = 1;
+      napi_value argv[1];
+      napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
 
-      if (args.Length() < 1 || !args[0]->IsString()) {
-        isolate->ThrowException(
-                Exception::TypeError(
-                    String::NewFromUtf8(isolate, "First argument must be an IP.")));
-        return;
+      if (argc < 1 || js_typeof(env, argv[0]) != napi_string) {
+        js_throw_type(env, "Required argument: path.");
+        return NULL;
       }
-      if (args.Length() < 2 || !args[1]->IsNumber()){
-        isolate->ThrowException(
-          Exception::TypeError(
-            String::NewFromUtf8(isolate, "Second argument must be a prefix length")));
-        return;
+      std::string path = js_utf8(env, argv[0]);
+      size_t len;
+      const char *err;
+      const void *img = map_image(path.c_str(), &len, &err);
+      if(!img) {
+        js_throw(env, err);
+        return NULL;
+      }
+
+      napi_value obj = ImageInstance(env, img, len, NULL);
+      if(!obj) unmap_image(img, len);
+      return obj;
+    }
+
+    /* save, then tell subscribers; returns the new generation */
+    static napi_value Publish(napi_env env, napi_callback_info info) {
+      size_t argc = 1;
+      napi_value argv[1];
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      if(!iptrie) return NULL;
+
+      if (argc < 1 || js_typeof(env, argv[0]) != napi_string) {
+        js_throw_type(env, "Required argument: path.");
+        return NULL;
+      }
+      std::string path = js_utf8(env, argv[0]);
+
+      void *img = NULL;
+      const void *out = iptrie->image;
+      size_t len = iptrie->image_len;
+      if(!out && (out = img = iptrie->BuildImage(&len)) == NULL) return NULL;
+      int rv = write_image(path.c_str(), out, len);
+      int err = errno;
+      free(img);
+      if(rv < 0) {
+        js_throw_errno(env, err, "publish", path.c_str());
+        return NULL;
+      }
+      const char *gerr;
+      uint64_t *gen = map_generation(path.c_str(), 1, &gerr);
+      if(!gen) {
+        js_throw(env, gerr);
+        return NULL;
+      }
+      uint64_t g = bump_generation(gen);
+      unmap_generation(gen);
+      return js_number(env, g);
+    }
+
+    static napi_value Subscribe(napi_env env, napi_callback_info info) {
+      size_t argc = 1;
+      napi_value argv[1];
+      napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+      if (argc < 1 || js_typeof(env, argv[0]) != napi_string) {
+        js_throw_type(env, "Required argument: path.");
+        return NULL;
+      }
+      std::string path = js_utf8(env, argv[0]);
+      size_t len;
+      const char *err;
+      uint64_t *gen = map_generation(path.c_str(), 0, &err), g;
+      const void *img = NULL;
+      /* the generation first: an image at least that new is in place */
+      if(gen) {
+        g = read_generation(gen);
+        img = map_image(path.c_str(), &len, &err);
+      }
+      if(!img) {
+        unmap_generation(gen);
+        js_throw(env, err);
+        return NULL;
       }
 
-      String::Utf8Value ipaddress(args[0]->ToString());
-      int prefix_len = args[1]->ToUint32()->Value();
+      napi_value obj = ImageInstance(env, img, len, NULL);
+      if(!obj) {
+        unmap_image(img, len);
+        unmap_generation(gen);
+        return NULL;
+      }
+      IPTrie *iptrie;
+      napi_unwrap(env, obj, (void **)&iptrie);
+      iptrie->source = path;
+      iptrie->published = gen;
+      iptrie->generation = g;
+      return obj;
+    }
 
-      IPTrie *iptrie = ObjectWrap::Unwrap<IPTrie>(args.This());
-      int success = iptrie->Del(*ipaddress, prefix_len);
+    /* the generation a subscriber is serving, after moving to the latest */
+    static napi_value Generation(napi_env env, napi_callback_info info) {
+      IPTrie *iptrie = Unwrap(env, info, NULL, NULL);
+      if(!iptrie) return NULL;
+      iptrie->Refresh();
+      return js_number(env, iptrie->generation);
+    }
 
-      args.GetReturnValue().Set(success ? True(isolate) : False(isolate));
+    static void free_output(napi_env env, void *data, void *hint) {
+      free(data);
     }
 
-    static void Find(const FunctionCallbackInfo<Value> &args) {
-      Isolate *isolate = args.GetIsolate();
+    static napi_value Annotate(napi_env env, napi_callback_info info) {
+      size_t argc = 2;
+      napi_value argv[2], output = NULL;
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      annotate_t a;
+      if(!iptrie) return NULL;
 
-      if (args.Length() < 1 || !args[0]->IsString()) {
-        isolate->ThrowException(
-                Exception::TypeError(
-                    String::NewFromUtf8(isolate, "Required argument: ip address.")));
-        return;
+      if (argc < 1 || !js_is_buffer(env, argv[0])) {
+        js_throw_type(env, "Required argument: buffer.");
+        return NULL;
+      }
+      a.field = 0;
+      a.separator = " ";
+      a.missing = "-";
+      if (argc > 1 && js_typeof(env, argv[1]) == napi_object) {
+        napi_value v = js_get(env, argv[1], "field");
+        if(js_is_uint32(env, v)) a.field = js_uint32(env, v);
+        v = js_get(env, argv[1], "separator");
+        if(js_typeof(env, v) == napi_string) a.separator = js_utf8(env, v);
+        v = js_get(env, argv[1], "missing");
+        if(js_typeof(env, v) == napi_string) a.missing = js_utf8(env, v);
+        v = js_get(env, argv[1], "output");
+        if(js_is_buffer(env, v)) output = v;
       }
 
-      String::Utf8Value ipaddress(args[0]->ToString());
+      void *in;
+      size_t in_len;
+      napi_get_buffer_info(env, argv[0], &in, &in_len);
+      a.len = 0;
+      if(output) {
+        void *out;
+        napi_get_buffer_info(env, output, &out, &a.cap);
+        a.out = (char *)out;
+        a.owned = false;
+      }
+      else {
+        a.cap = in_len + in_len / 4 + 64;
+        a.out = (char *)malloc(a.cap);
+        a.owned = true;
+      }
+      iptrie->Refresh();
+      iptrie->Annotate(&a, (const char *)in, in_len);
 
-      IPTrie *iptrie = ObjectWrap::Unwrap<IPTrie>(args.This());
-      obj_baton_t *d = iptrie->Find(*ipaddress);
-      if(d != NULL) {
-        args.GetReturnValue().Set(d->val);
+      napi_value result;
+      if(a.owned) {
+        /* handed over, not copied */
+        if(napi_create_external_buffer(env, a.len, a.out, free_output, NULL, &result) != napi_ok) {
+          free(a.out);
+          return NULL;
+        }
+        return result;
       }
+      napi_value slice_argv[2] = { js_int(env, 0), js_number(env, a.len) };
+      if(napi_call_function(env, output, js_get(env, output, "slice"), 2, slice_argv,
+                            &result) != napi_ok) return NULL;
+      return result;
+    }
+
+    static napi_value AddBulk(napi_env env, napi_callback_info info) {
+      size_t argc = 2;
+      napi_value argv[2];
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      if(!iptrie) return NULL;
+      bool line_values = argc > 1 && LineValues(env, argv[1]);
+      int n;
+
+      if(ReadOnly(env, iptrie) || ListsMode(env, iptrie, "addBulk")) return NULL;
+      if (argc > 0 && js_is_buffer(env, argv[0])) {
+        void *data;
+        size_t len;
+        napi_get_buffer_info(env, argv[0], &data, &len);
+        n = iptrie->AddBulk((const char *)data, len, line_values);
+      }
+      else if (argc > 0 && js_typeof(env, argv[0]) == napi_string) {
+        std::string text = js_utf8(env, argv[0]);
+        n = iptrie->AddBulk(text.data(), text.size(), line_values);
+      }
+      else {
+        js_throw_type(env, "Required argument: Buffer or string of routes.");
+        return NULL;
+      }
+      return n >= 0 ? js_int(env, n) : NULL;
+    }
+
+    static napi_value FromFile(napi_env env, napi_callback_info info) {
+      size_t argc = 2;
+      napi_value argv[2];
+      napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+      if (argc < 1 || js_typeof(env, argv[0]) != napi_string) {
+        js_throw_type(env, "Required argument: path.");
+        return NULL;
+      }
+      std::string path = js_utf8(env, argv[0]);
+      int fd = open(path.c_str(), O_RDONLY);
+      struct stat sb;
+      if(fd < 0 || fstat(fd, &sb) < 0) {
+        int err = errno;
+        if(fd >= 0) close(fd);
+        js_throw_errno(env, err, "open", path.c_str());
+        return NULL;
+      }
+      void *text = NULL;
+      if(sb.st_size > 0) {
+        text = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(text == MAP_FAILED) {
+          int err = errno;
+          close(fd);
+          js_throw_errno(env, err, "mmap", path.c_str());
+          return NULL;
+        }
+      }
+      close(fd);
+
+      napi_value opts = argc > 1 ? argv[1] : js_undefined(env);
+      napi_value obj = NewInstance(env, 1, &opts);
+      IPTrie *iptrie;
+      int n = -1;
+      if(obj) {
+        napi_unwrap(env, obj, (void **)&iptrie);
+        n = 0;
+      }
+      if(text) {
+        if(obj)
+          n = iptrie->AddBulk((const char *)text, sb.st_size,
+                              argc > 1 && LineValues(env, argv[1]));
+        munmap(text, sb.st_size);
+      }
+      return n >= 0 ? obj : NULL;
+    }
+
+    static napi_value FindAll(napi_env env, napi_callback_info info) {
+      size_t argc = 1;
+      napi_value argv[1];
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      if(!iptrie) return NULL;
+
+      if (argc < 1 || !IsAddress(env, argv[0])) {
+        js_throw_type(env, "Required argument: ip address.");
+        return NULL;
+      }
+      if (iptrie->image) {
+        js_throw(env, "findAll is not available on an image");
+        return NULL;
+      }
+
+      uint32_t key[4], words[4];
+      void *out[129];
+      unsigned char lens[129];
+      int i, n, family = AddressArg(env, argv[0], key);
+      if(family == 0) return NULL;
+      if(family == AF_INET) n = find_all_ipv4_key(&iptrie->tree4, key[0], out, lens);
+      else n = find_all_ipv6_key(&iptrie->tree6, key, out, lens);
+
+      napi_value result = js_array(env, n);
+      for(i=0;i<n;i++) {
+        int j, width = family == AF_INET ? 1 : 4;
+        /* the route's own key is the address masked to its length */
+        for(j=0;j<width;j++) {
+          int bits = lens[i] - 32*j;
+          words[j] = bits >= 32 ? key[j] : bits <= 0 ? 0 : key[j] & ~(0xffffffff >> bits);
+        }
+        js_set_at(env, result, i, iptrie->RouteObject(family, words, lens[i], out[i]));
+      }
+      return result;
+    }
+
+    static napi_value Walk(napi_env env, napi_callback_info info) {
+      size_t argc = 3;
+      napi_value argv[3];
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      if(!iptrie) return NULL;
+
+      if (argc < 3 || !IsAddress(env, argv[0]) || js_typeof(env, argv[1]) != napi_number ||
+          js_typeof(env, argv[2]) != napi_function) {
+        js_throw_type(env, "Required arguments: ip address, prefix length, callback.");
+        return NULL;
+      }
+      if (iptrie->image) {
+        js_throw(env, "walk is not available on an image");
+        return NULL;
+      }
+
+      uint32_t key[4];
+      int family = AddressArg(env, argv[0], key);
+      int prefix_len = js_uint32(env, argv[1]);
+      if(family == 0 || prefix_len > (family == AF_INET ? 32 : 128)) {
+        js_throw_type(env, "Could not parse prefix");
+        return NULL;
+      }
+
+      walk_ctx_t ctx = { env, iptrie, family, argv[2], false };
+      int stopped;
+      /* the callback may only change the trie through applyDiff */
+      uint64_t e = iptrie->ReaderStart();
+      if(family == AF_INET)
+        stopped = walk_ipv4_key(&iptrie->tree4, key[0], prefix_len, walk_route, &ctx);
+      else
+        stopped = walk_ipv6_key(&iptrie->tree6, key, prefix_len, walk_route, &ctx);
+      iptrie->ReaderStop();
+      iptrie->ReaderDone(e);
+      return ctx.threw ? NULL : js_bool(env, !stopped);
+    }
+
+    struct drain_ctx_t {
+      IPTrie *iptrie;
+      int family;
+      napi_value result;
+      uint32_t n;
+    };
+
+    static int drain_route(void *vctx, const uint32_t *key,
+                           unsigned char prefix_len, void *data) {
+      drain_ctx_t *ctx = (drain_ctx_t *)vctx;
+      IPTrie *iptrie = ctx->iptrie;
+      counted_route_t *c = (counted_route_t *)data;
+      uint64_t packets = c->packets.exchange(0, std::memory_order_relaxed);
+      uint64_t bytes = c->bytes.exchange(0, std::memory_order_relaxed);
+      if(!packets && !bytes) return 0;
+      napi_value obj = iptrie->RouteObject(ctx->family, key, prefix_len, data);
+      js_set(iptrie->env, obj, "packets", js_number(iptrie->env, packets));
+      js_set(iptrie->env, obj, "bytes", js_number(iptrie->env, bytes));
+      js_set_at(iptrie->env, ctx->result, ctx->n++, obj);
+      return 0;
+    }
+
+    /* the routes counted since the last drain, their counts reset */
+    static napi_value DrainCounters(napi_env env, napi_callback_info info) {
+      IPTrie *iptrie = Unwrap(env, info, NULL, NULL);
+      if(!iptrie) return NULL;
+      if(!iptrie->counting) {
+        js_throw(env, "drainCounters needs the counters option");
+        return NULL;
+      }
+
+      uint32_t zero[4] = { 0, 0, 0, 0 };
+      drain_ctx_t ctx = { iptrie, AF_INET, js_array(env, 0), 0 };
+      walk_ipv4_key(&iptrie->tree4, 0, 0, drain_route, &ctx);
+      ctx.family = AF_INET6;
+      walk_ipv6_key(&iptrie->tree6, zero, 0, drain_route, &ctx);
+      return ctx.result;
+    }
+
+    static bool IsList(napi_env env, napi_value v) {
+      napi_valuetype t = js_typeof(env, v);
+      return js_is_array(env, v) || t == napi_null || t == napi_undefined;
+    }
+
+    static napi_value ApplyDiff(napi_env env, napi_callback_info info) {
+      size_t argc = 2;
+      napi_value argv[2];
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      std::vector<diff_op_t> adds, dels;
+      const char *err = NULL;
+      uint32_t i;
+      if(!iptrie || ListsMode(env, iptrie, "applyDiff")) return NULL;
+
+      if(iptrie->image) {
+        js_throw(env, "IPTrie loaded from an image is read-only");
+        return NULL;
+      }
+      if((argc > 0 && !IsList(env, argv[0])) || (argc > 1 && !IsList(env, argv[1]))) {
+        js_throw_type(env, "Arguments must be arrays of adds and deletes.");
+        return NULL;
+      }
+      if(argc > 1 && js_is_array(env, argv[1])) {
+        dels.resize(js_length(env, argv[1]));
+        for(i=0;i<dels.size() && !err;i++)
+          if(!DiffOp(env, js_at(env, argv[1], i), false, dels[i]))
+            err = "Bad delete: expected [ip, prefix_length]";
+      }
+      if(argc > 0 && js_is_array(env, argv[0])) {
+        adds.resize(js_length(env, argv[0]));
+        for(i=0;i<adds.size() && !err;i++)
+          if(!DiffOp(env, js_at(env, argv[0], i), true, adds[i]))
+            err = "Bad add: expected [ip, prefix_length, value]";
+        /* values last, once nothing else can fail */
+        for(i=0;i<adds.size() && !err;i++) {
+          napi_value v = js_at(env, js_at(env, argv[0], i), 2);
+          if((adds[i].data = iptrie->NewData(v)) == NULL) {
+            void (*f)(void *) = iptrie->DataFree();
+            while(f && i-- > 0) f(adds[i].data);
+            return NULL;
+          }
+        }
+      }
+      if(err) {
+        js_throw_type(env, err);
+        return NULL;
+      }
+
+      int added, deleted;
+      iptrie->ApplyDiff(adds, dels, &added, &deleted);
+      napi_value result = js_object(env);
+      js_set(env, result, "added", js_int(env, added));
+      js_set(env, result, "deleted", js_int(env, deleted));
+      return result;
+    }
+
+    static napi_value FindManyAsync(napi_env env, napi_callback_info info) {
+      size_t argc = 4;
+      napi_value argv[4], promise = NULL;
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      const uint32_t *lengths;
+      int family, n;
+      if(!iptrie || ListsMode(env, iptrie, "findManyAsync")) return NULL;
+
+      if (argc == 0 || !js_is_view(env, argv[0])) {
+        js_throw_type(env, "Required argument: Uint32Array or packed buffer of addresses.");
+        return NULL;
+      }
+
+      async_batch_t *batch = new async_batch_t();
+      if((n = PackedArg(env, argc, argv, batch->keys, &family)) < 0 ||
+         !LengthsArg(env, argc, argv, n, &lengths)) {
+        delete batch;
+        return NULL;
+      }
+      /* a copy, as the workers cannot hold on to JS memory */
+      if(lengths && iptrie->counting) batch->lengths.assign(lengths, lengths + n);
+      batch->iptrie = iptrie;
+      batch->family = family;
+      void *out;
+      napi_value ab, result;
+      napi_create_arraybuffer(env, n * sizeof(uint32_t), &out, &ab);
+      napi_create_typedarray(env, napi_uint32_array, n, ab, 0, &result);
+      batch->out = (uint32_t *)out;
+      napi_create_reference(env, result, 1, &batch->result);
+      if (js_typeof(env, argv[argc-1]) == napi_function)
+        napi_create_reference(env, argv[argc-1], 1, &batch->callback);
+      else {
+        napi_create_promise(env, &batch->deferred, &promise);
+        napi_create_reference(env, promise, 1, &batch->promise);
+      }
+
+      iptrie->Refresh();
+      batch->tree4 = iptrie->tree4;
+      batch->tree4.dir = NULL;
+      batch->tree4.filter = NULL;
+      batch->tree6 = iptrie->tree6;
+      batch->tree6.filter = NULL;
+      batch->compiled4 = iptrie->compiled4;
+      batch->compiled6 = iptrie->compiled6;
+      batch->epoch = iptrie->ReaderStart();
+      iptrie->Ref();
+      batch->pending = n > 0 ? (n + ASYNC_CHUNK - 1) / ASYNC_CHUNK : 1;
+      napi_value name = js_string(env, "IPTrie.findManyAsync");
+      for(int i=0;i<batch->pending;i++) {
+        async_chunk_t *chunk = new async_chunk_t();
+        chunk->batch = batch;
+        chunk->start = (size_t)i * ASYNC_CHUNK;
+        chunk->count = n - chunk->start < ASYNC_CHUNK ? n - chunk->start : ASYNC_CHUNK;
+        napi_create_async_work(env, NULL, name, AsyncWork, AsyncDone, chunk, &chunk->work);
+        napi_queue_async_work(env, chunk->work);
+      }
+      return promise;
+    }
+
+    static napi_value ValueOf(napi_env env, napi_callback_info info) {
+      size_t argc = 1;
+      napi_value argv[1];
+      IPTrie *iptrie = Unwrap(env, info, &argc, argv);
+      if(!iptrie || ListsMode(env, iptrie, "value")) return NULL;
+      if (argc < 1 || !js_is_uint32(env, argv[0])) {
+        js_throw_type(env, "Required argument: value index.");
+        return NULL;
+      }
+      return iptrie->ValueAt(js_uint32(env, argv[0]));
     }
 
   private:
-    btrie tree4;
-    btrie tree6;
+    napi_env env;
+    /* weak unless async lookups are pending */
+    napi_ref self;
+    /* route values, element id for baton id */
+    napi_ref values;
+    value_mode_t value_mode;
+    /* lists mode: keep list_route_t.all up to date */
+    bool precompute;
+    /* route data is counted_route_t */
+    bool counting;
+    std::map<std::string, obj_baton_t *> interned;
+    btrie4 tree4;
+    btrie6 tree6;
+    btrie_compiled *compiled4;
+    btrie_compiled *compiled6;
+    /* set when loaded from an image or shared memory; the trees stay empty */
+    const void *image;
+    size_t image_len;
+    /* decoded values, element n for value n */
+    napi_ref image_values;
+    napi_ref image_owner;
+    /* subscribers: the published path and its generation counter */
+    std::string source;
+    uint64_t *published;
+    uint64_t generation;
+    /* baton ids: batons[id-1], with the ids of deleted batons reused */
+    std::vector<obj_baton_t *> batons;
+    std::vector<uint32_t> free_ids;
+    uint64_t epoch;
+    std::multiset<uint64_t> active;
+    /* readers in active still looking at the trees */
+    int running;
+    std::vector<retired_t> retiring;
+    cache_entry_t *cache;
+    uint32_t cache_mask;
+    uint64_t cache_hits, cache_misses;
+    /* cumulative, only ever touched on the main thread */
+    struct {
+      uint64_t add, del, find, hit, miss;
+    } ops;
 };
 
-Persistent<FunctionTemplate> IPTrie::s_ct;
-
-extern "C" {
-static void init(Handle<Object> target) {
-  IPTrie::Initialize(target);
-}
-NODE_MODULE(iptrie, init);
+static napi_value Init(napi_env env, napi_value exports) {
+  return IPTrie::Initialize(env, exports);
 }
+
+NAPI_MODULE(iptrie, Init)
@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2011, OmniTI Computer Consulting, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name OmniTI Computer Consulting, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A benchmark for the trie on its own, without node: build with
+ *
+ *   node-gyp configure -- -Dbench=1 && node-gyp build
+ *
+ * and run build/Release/btrie_bench -h for the options.  A synthetic
+ * table is generated, inserted, looked up with addresses that hit a
+ * route and addresses that miss, partly deleted and then torn down, and
+ * each phase is timed.  Lookup latency is sampled over groups of
+ * LOOKUP_GROUP lookups, since one lookup is shorter than the clock can
+ * resolve.  Where perf_event_open is allowed, instructions, cycles and
+ * cache misses per lookup are reported as well.
+ */
+
+#include "btrie.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define LOOKUP_GROUP 64
+
+typedef struct {
+  uint32_t key[4];
+  unsigned char prefix_len;
+} route_t;
+
+/* prefix length weights, in percent, of a full table */
+typedef struct {
+  unsigned char len;
+  int pct;
+} weight_t;
+
+static const weight_t bgp4[] = {
+  { 8, 1 }, { 12, 1 }, { 14, 1 }, { 16, 3 }, { 17, 1 }, { 18, 2 }, { 19, 4 },
+  { 20, 5 }, { 21, 5 }, { 22, 12 }, { 23, 9 }, { 24, 56 }, { 0, 0 }
+}, bgp6[] = {
+  { 28, 1 }, { 29, 6 }, { 32, 15 }, { 36, 4 }, { 40, 7 }, { 44, 9 },
+  { 46, 2 }, { 47, 2 }, { 48, 52 }, { 56, 1 }, { 64, 1 }, { 0, 0 }
+};
+
+static uint64_t rng_state = 88172645463325252ULL;
+static uint32_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (uint32_t)(rng_state >> 16);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void mask_key(uint32_t *key, int width, int len) {
+  int i;
+  for(i=0;i<width/32;i++) {
+    int bits = len - i*32;
+    if(bits <= 0) key[i] = 0;
+    else if(bits < 32) key[i] &= ~(0xffffffffu >> bits);
+  }
+}
+
+static unsigned char pick_len(const char *table, int width) {
+  int r, i;
+  if(!strcmp(table, "uniform")) return width == 32 ? 8 + rng() % 25 : 16 + rng() % 113;
+  if(!strcmp(table, "blocklist")) {
+    /* mostly single hosts, some whole networks */
+    r = rng() % 100;
+    if(width == 32) return r < 85 ? 32 : r < 97 ? 24 : 16;
+    return r < 70 ? 128 : r < 95 ? 64 : 48;
+  }
+  r = rng() % 100;
+  const weight_t *w = width == 32 ? bgp4 : bgp6;
+  for(i=0; w[i+1].len && r >= w[i].pct; i++) r -= w[i].pct;
+  return w[i].len;
+}
+
+static void generate(route_t *routes, size_t n, const char *table, int width) {
+  size_t i;
+  int j;
+  for(i=0;i<n;i++) {
+    for(j=0;j<4;j++) routes[i].key[j] = j < width/32 ? rng() : 0;
+    if(width == 128) {
+      /* global unicast, 2000::/3 */
+      routes[i].key[0] = 0x20000000 | (routes[i].key[0] & 0x1fffffff);
+    }
+    else if(strcmp(table, "uniform")) {
+      /* unicast space only: 1.0.0.0 to 223.255.255.255 */
+      routes[i].key[0] = ((1 + rng() % 223) << 24) | (routes[i].key[0] & 0xffffff);
+    }
+    routes[i].prefix_len = pick_len(table, width);
+    mask_key(routes[i].key, width, routes[i].prefix_len);
+  }
+}
+
+#ifdef __linux__
+static int perf_open(uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+typedef struct {
+  int fd[3];
+  uint64_t count[3];
+} counters_t;
+
+static const char *counter_names[3] = { "instructions", "cycles", "cache misses" };
+
+static void counters_start(counters_t *c, int enable) {
+  int i;
+  for(i=0;i<3;i++) {
+    c->fd[i] = -1;
+    c->count[i] = 0;
+  }
+#ifdef __linux__
+  static const uint64_t config[3] = {
+    PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES
+  };
+  for(i=0;enable && i<3;i++) {
+    if((c->fd[i] = perf_open(config[i])) < 0) continue;
+    ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+#else
+  (void)enable;
+#endif
+}
+
+static void counters_stop(counters_t *c) {
+  int i;
+  for(i=0;i<3;i++) {
+    if(c->fd[i] < 0) continue;
+#ifdef __linux__
+    ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    if(read(c->fd[i], &c->count[i], sizeof(c->count[i])) != sizeof(c->count[i]))
+      c->count[i] = 0;
+#endif
+    close(c->fd[i]);
+  }
+}
+
+static void *lookup(void *tree, int width, const uint32_t *key) {
+  if(width == 32) return find_bpm_route_ipv4_key((btrie4 *)tree, key[0], NULL);
+  return find_bpm_route_ipv6_key((btrie6 *)tree, key, NULL);
+}
+
+static int count_route(void *ctx, const uint32_t *, unsigned char, void *) {
+  (*(size_t *)ctx)++;
+  return 0;
+}
+
+static void run_lookups(const char *what, void *tree, int width,
+                        const uint32_t *keys, size_t n, int perf) {
+  double *lat = (double *)malloc((n / LOOKUP_GROUP + 1) * sizeof(*lat));
+  size_t i, j, groups = 0, found = 0;
+  double start, total = 0;
+  counters_t c;
+  int k;
+
+  counters_start(&c, perf);
+  for(i=0;i+LOOKUP_GROUP<=n;i+=LOOKUP_GROUP) {
+    start = now();
+    for(j=i;j<i+LOOKUP_GROUP;j++) found += lookup(tree, width, keys + j*4) != NULL;
+    lat[groups] = (now() - start) * 1e9 / LOOKUP_GROUP;
+    total += lat[groups++];
+  }
+  counters_stop(&c);
+  if(!groups) {
+    printf("%-6s lookups: none to make\n", what);
+    free(lat);
+    return;
+  }
+  std::sort(lat, lat + groups);
+  printf("%-6s lookups %8zu  %6.1f ns mean  p50 %6.1f  p90 %6.1f  p99 %6.1f  p99.9 %6.1f  (%zu found)\n",
+         what, groups * LOOKUP_GROUP, total / groups, lat[groups/2], lat[groups*9/10],
+         lat[groups*99/100], lat[groups*999/1000], found);
+  for(k=0;k<3;k++)
+    if(c.fd[k] >= 0)
+      printf("       %-13s %8.1f per lookup\n", counter_names[k],
+             (double)c.count[k] / (groups * LOOKUP_GROUP));
+  free(lat);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-6] [-c] [-d] [-f] [-p] [-t bgp|blocklist|uniform] [-n routes]\n"
+          "          [-q lookups] [-s seed]\n"
+          "  -6  IPv6 rather than IPv4\n"
+          "  -c  compact after the deletes, with hit lookups either side\n"
+          "  -d  enable the dir24 table (IPv4)\n"
+          "  -f  enable the prefilter\n"
+          "  -p  report perf_event counters per lookup\n",
+          prog);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *table = "bgp";
+  size_t n = 500000, nq = 1000000, i, routes = 0, deleted = 0;
+  int width = 32, compact = 0, dir24 = 0, filter = 0, perf = 0, ch, j;
+  btrie4 tree4;
+  btrie6 tree6;
+  void *tree;
+  btrie_alloc_stats st;
+  double start, elapsed;
+
+  while((ch = getopt(argc, argv, "6cdfpt:n:q:s:h")) != -1) {
+    switch(ch) {
+      case '6': width = 128; break;
+      case 'c': compact = 1; break;
+      case 'd': dir24 = 1; break;
+      case 'f': filter = 1; break;
+      case 'p': perf = 1; break;
+      case 't': table = optarg; break;
+      case 'n': n = strtoul(optarg, NULL, 10); break;
+      case 'q': nq = strtoul(optarg, NULL, 10); break;
+      case 's': rng_state = strtoull(optarg, NULL, 10) | 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if(strcmp(table, "bgp") && strcmp(table, "blocklist") && strcmp(table, "uniform"))
+    usage(argv[0]);
+
+  route_t *table_routes = (route_t *)malloc(n * sizeof(*table_routes));
+  uint32_t *hits = (uint32_t *)malloc(nq * 4 * sizeof(uint32_t));
+  uint32_t *misses = (uint32_t *)malloc(nq * 4 * sizeof(uint32_t));
+  size_t nmiss = 0, tries;
+  generate(table_routes, n, table, width);
+
+  init_tree(&tree4);
+  init_tree(&tree6);
+  if(width == 32 && dir24) enable_dir24(&tree4);
+  if(filter) {
+    enable_prefilter(&tree4);
+    enable_prefilter(&tree6);
+  }
+  tree = width == 32 ? (void *)&tree4 : (void *)&tree6;
+
+  printf("%s IPv%d table, %zu prefixes generated%s%s\n", table, width == 32 ? 4 : 6, n,
+         dir24 && width == 32 ? ", dir24" : "", filter ? ", prefilter" : "");
+  start = now();
+  for(i=0;i<n;i++) {
+    if(width == 32)
+      add_route_ipv4_key(&tree4, table_routes[i].key[0], table_routes[i].prefix_len,
+                         (void *)(uintptr_t)(i+1), NULL);
+    else
+      add_route_ipv6_key(&tree6, table_routes[i].key, table_routes[i].prefix_len,
+                         (void *)(uintptr_t)(i+1), NULL);
+  }
+  elapsed = now() - start;
+  if(width == 32) walk_ipv4_key(&tree4, 0, 0, count_route, &routes);
+  else {
+    uint32_t zero[4] = { 0, 0, 0, 0 };
+    walk_ipv6_key(&tree6, zero, 0, count_route, &routes);
+  }
+  printf("insert  %10.0f prefixes/s  (%zu distinct)\n", n / elapsed, routes);
+  if(width == 32) tree_alloc_stats(&tree4, &st);
+  else tree_alloc_stats(&tree6, &st);
+  printf("memory  %10zu bytes, %zu nodes, %.1f bytes/prefix\n", st.bytes, st.nodes_used,
+         routes ? (double)st.bytes / routes : 0.0);
+
+  /* hits land inside a random route; misses are kept only if they miss */
+  for(i=0;i<nq;i++) {
+    route_t *r = &table_routes[rng() % n];
+    for(j=0;j<4;j++) {
+      int bits = r->prefix_len - j*32;
+      uint32_t host = j < width/32 ? rng() : 0;
+      if(bits >= 32) hits[i*4+j] = r->key[j];
+      else if(bits <= 0) hits[i*4+j] = host;
+      else hits[i*4+j] = r->key[j] | (host & (0xffffffffu >> bits));
+    }
+  }
+  for(tries=0;nmiss<nq && tries<nq*8;tries++) {
+    uint32_t *k = misses + nmiss*4;
+    for(j=0;j<4;j++) k[j] = j < width/32 ? rng() : 0;
+    if(!lookup(tree, width, k)) nmiss++;
+  }
+  run_lookups("hit", tree, width, hits, nq, perf);
+  run_lookups("miss", tree, width, misses, nmiss, perf);
+
+  /* a tenth of the table, in generation order */
+  start = now();
+  for(i=0;i<n/10;i++) {
+    if(width == 32)
+      deleted += del_route_ipv4_key(&tree4, table_routes[i].key[0], table_routes[i].prefix_len, NULL);
+    else
+      deleted += del_route_ipv6_key(&tree6, table_routes[i].key, table_routes[i].prefix_len, NULL);
+  }
+  elapsed = now() - start;
+  printf("delete  %10.0f prefixes/s  (%zu deleted)\n", n/10 / elapsed, deleted);
+
+  if(compact) {
+    run_lookups("before", tree, width, hits, nq, perf);
+    start = now();
+    if(width == 32) compact_tree(&tree4);
+    else compact_tree(&tree6);
+    printf("compact %9.3f ms\n", (now() - start) * 1e3);
+    run_lookups("after", tree, width, hits, nq, perf);
+  }
+
+  start = now();
+  drop_tree(&tree4, NULL);
+  drop_tree(&tree6, NULL);
+  printf("teardown %9.3f ms\n", (now() - start) * 1e3);
+
+  free(table_routes);
+  free(hits);
+  free(misses);
+  return 0;
+}
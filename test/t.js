@@ -36,5 +36,370 @@ fs.readFile("test/test.cidr", 'utf-8', function(err, data) {
     assert.equal(result, expectations[target],
                  "test "+target + " ["+result+" != "+expectations[target]+"]");
   }
-});
 
+  assert.equal(lookup.find(0x0a780201), 'rfc1918', "find by number");
+  assert.equal(lookup.find(Buffer.from([75,49,14,236])), 'boom', "find by buffer");
+  var v6 = Buffer.alloc(16);
+  v6.write("2001047000000076", 0, 'hex');
+  v6[15] = 2;
+  assert.equal(lookup.find(v6), 'website', "find by v6 buffer");
+  lookup.add(0x01020300, 24, 'binary');
+  assert.equal(lookup.find("1.2.3.4"), 'binary', "add by number");
+  assert.equal(lookup.del(Buffer.from([1,2,3,0]), 24), true, "del by buffer");
+  assert.throws(function() { lookup.find(-1); }, TypeError, "negative number address");
+  assert.throws(function() { lookup.find(1.5); }, TypeError, "fractional number address");
+  assert.throws(function() { lookup.add(4294967296, 32, 'x'); }, TypeError, "number address too big");
+
+  var targets = Object.keys(expectations);
+  var many = lookup.findMany(targets);
+  for(var i=0; i<targets.length; i++) {
+    assert.equal(many[i], expectations[targets[i]], "findMany "+targets[i]);
+  }
+  many = lookup.findMany(Buffer.from([10,120,2,1, 1,2,3,4, 75,49,14,236]));
+  assert.deepEqual(many, ['rfc1918', null, 'boom'], "findMany packed");
+  many = lookup.findMany([0x0a780201, Buffer.from([75,49,14,236]), -1, "10.120.2.1"]);
+  assert.deepEqual(many, ['rfc1918', 'boom', null, 'rfc1918'], "findMany mixed forms");
+
+  lookup.compile();
+  for(var target in expectations) {
+    var result = lookup.find(target);
+    assert.equal(result, expectations[target],
+                 "compiled "+target + " ["+result+" != "+expectations[target]+"]");
+  }
+  lookup.add("1.2.0.0", 16, "late");
+  assert.equal(lookup.find("1.2.3.4"), "late", "stale index falls back to the trie");
+  assert.deepEqual(lookup.findMany(["1.2.3.4", "10.120.2.1"]), ["late", "rfc1918"],
+                   "stale index findMany");
+  lookup.compile();
+  assert.equal(lookup.find("1.2.3.4"), "late", "recompiled after add");
+  assert.equal(lookup.del("1.2.0.0", 16), true, "compiled del");
+  assert.equal(lookup.find("1.2.3.4"), null, "stale index after del");
+  lookup.compile();
+  assert.equal(lookup.del("1.2.0.0", 16), false, "double del");
+
+  var alloc = lookup.allocStats();
+  assert.ok(alloc.ipv4.nodes > 0 && alloc.ipv4.slabs == 1, "allocStats ipv4");
+  assert.ok(alloc.ipv6.bytes >= alloc.ipv6.nodes * alloc.ipv6.nodeSize, "allocStats ipv6");
+
+  var direct = new iptrie.IPTrie({ dir24: true });
+  direct.add("10.0.0.0", 8, "eight");
+  direct.add("10.1.2.0", 24, "twentyfour");
+  direct.add("10.1.2.128", 25, "twentyfive");
+  direct.add("10.1.2.130", 32, "host");
+  assert.equal(direct.find("10.9.9.9"), "eight", "dir24 /8");
+  assert.equal(direct.find("10.1.2.1"), "twentyfour", "dir24 /24");
+  assert.equal(direct.find("10.1.2.129"), "twentyfive", "dir24 /25");
+  assert.equal(direct.find("10.1.2.130"), "host", "dir24 /32");
+  direct.del("10.1.2.128", 25);
+  assert.equal(direct.find("10.1.2.129"), "twentyfour", "dir24 after del");
+  assert.equal(direct.find("10.1.2.130"), "host", "dir24 keeps longer");
+  direct.add("10.1.0.0", 16, "sixteen");
+  assert.equal(direct.find("10.1.2.1"), "twentyfour", "dir24 longer wins");
+  assert.equal(direct.find("10.1.3.1"), "sixteen", "dir24 shorter fills");
+
+  var ints = new iptrie.IPTrie({ valueMode: "integer" });
+  ints.add("10.0.0.0", 8, 7);
+  ints.add("10.1.0.0", 16, 0);
+  assert.strictEqual(ints.find("10.2.0.1"), 7, "integer value");
+  assert.strictEqual(ints.find("10.1.0.1"), 0, "integer zero");
+  assert.throws(function() { ints.add("11.0.0.0", 8, "x"); }, "integer only");
+  var interned = iptrie.IPTrie.fromFile("test/test.cidr", { valueMode: "intern" });
+  interned.add("192.0.2.0", 24, "rfc1918");
+  assert.equal(interned.find("192.0.2.1"), "rfc1918", "interned value");
+  assert.equal(interned.find("10.80.117.4"), "my special place", "interned bulk");
+  interned.del("192.0.2.0", 24);
+  assert.equal(interned.find("10.1.1.1"), "rfc1918", "interned shared survives del");
+
+  assert.deepEqual(lookup.findAll("10.80.117.12").map(function(r) {
+    return r.prefix + "/" + r.length + " " + r.value;
+  }), ["10.0.0.0/8 rfc1918", "10.80.116.0/23 my special place",
+       "10.80.117.12/32 specific"], "findAll");
+  var walked = [];
+  assert.equal(lookup.walk("75.0.0.0", 8, function(prefix, len, value) {
+    walked.push(prefix + "/" + len);
+  }), true, "walk complete");
+  assert.deepEqual(walked, ["75.0.0.0/8", "75.0.0.0/11", "75.48.0.0/12",
+                            "75.51.207.0/24", "75.52.124.0/23"], "walk order");
+  walked = 0;
+  assert.equal(lookup.walk("::", 0, function() { walked++; return false; }),
+               false, "walk stopped");
+  assert.equal(walked, 1, "walk stops at false");
+  assert.throws(function() {
+    lookup.walk("10.0.0.0", 8, function() { lookup.del("10.0.0.0", 8); });
+  }, "no changes inside walk");
+
+  var cached = new iptrie.IPTrie({ cache: 64 });
+  cached.add("10.0.0.0", 8, "eight");
+  assert.equal(cached.find("10.1.1.1"), "eight", "cache fill");
+  assert.equal(cached.find("10.1.1.1"), "eight", "cache hit");
+  cached.add("10.1.0.0", 16, "sixteen");
+  assert.equal(cached.find("10.1.1.1"), "sixteen", "cache invalidated by add");
+  cached.del("10.1.0.0", 16);
+  assert.equal(cached.find("10.1.1.1"), "eight", "cache invalidated by del");
+  var cs = cached.cacheStats();
+  assert.ok(cs.entries >= 64 && cs.hits == 1 && cs.misses == 3, "cacheStats");
+
+  var image = require('os').tmpdir() + "/iptrie-test-" + process.pid + ".img";
+  lookup.add("192.0.2.0", 24, 42);
+  lookup.save(image);
+  var loaded = iptrie.IPTrie.load(image);
+  fs.unlinkSync(image);
+  for(var target in expectations) {
+    assert.equal(loaded.find(target), expectations[target], "loaded "+target);
+  }
+  assert.strictEqual(loaded.find("192.0.2.1"), 42, "loaded number");
+  assert.deepEqual(loaded.findMany(["10.120.2.1", "1.2.3.4"]), ['rfc1918', null],
+                   "loaded findMany");
+  assert.throws(function() { loaded.add("1.0.0.0", 8, "x"); }, "loaded read-only");
+
+  var shared = iptrie.IPTrie.fromShared(lookup.freeze());
+  for(var target in expectations) {
+    assert.equal(shared.find(target), expectations[target], "shared "+target);
+  }
+  assert.strictEqual(iptrie.IPTrie.fromShared(loaded.freeze()).find("192.0.2.1"), 42,
+                     "shared from loaded image");
+
+  lookup.findManyAsync(Buffer.from([10,120,2,1, 1,2,3,4, 75,49,14,236]), function(err, ids) {
+    assert.ifError(err);
+    assert.deepEqual([lookup.value(ids[0]), ids[1], lookup.value(ids[2])],
+                     ['rfc1918', 0, 'boom'], "findManyAsync");
+    lookup.add("1.0.0.0", 8, "after async");
+  });
+  assert.throws(function() { lookup.add("1.0.0.0", 8, "x"); }, "no add in flight");
+  shared.findManyAsync(new Uint32Array([0x0a780201])).then(function(ids) {
+    assert.equal(shared.value(ids[0]), 'rfc1918', "findManyAsync promise");
+  });
+
+  var bulk = iptrie.IPTrie.fromFile("test/test.cidr");
+  for(var target in expectations) {
+    assert.equal(bulk.find(target), expectations[target], "fromFile "+target);
+  }
+  var sorted = new iptrie.IPTrie();
+  assert.equal(sorted.addBulk("10.0.0.0/8 a\n10.1.0.0/16 b\nbogus\n10.1.2.0/24 c\n",
+                              { values: "line" }), 3, "addBulk count");
+  assert.equal(sorted.find("10.1.2.3"), 3, "addBulk line value");
+  assert.equal(sorted.find("10.1.3.3"), 1, "addBulk sorted");
+  sorted.addBulk(Buffer.from("9.0.0.0/8 nine\r\n"));
+  assert.equal(sorted.find("9.1.1.1"), "nine", "addBulk buffer");
+
+  var diffed = new iptrie.IPTrie();
+  assert.deepEqual(diffed.applyDiff([["10.0.0.0", 8, "ten"], ["10.1.0.0", 16, "old"],
+                                     ["2001:db8::", 32, "doc"]], null),
+                   { added: 3, deleted: 0 }, "applyDiff adds");
+  assert.throws(function() { diffed.applyDiff([["10.2.0.0", 16, "x"], ["bogus", 8, "y"]]); },
+                "applyDiff bad entry");
+  assert.equal(diffed.find("10.2.3.4"), "ten", "applyDiff all or nothing");
+  var seen = [];
+  diffed.walk("0.0.0.0", 0, function(prefix, length, value) {
+    if(seen.push(prefix + "/" + length) == 1)
+      assert.deepEqual(diffed.applyDiff([["10.1.0.0", 16, "new"], ["11.0.0.0", 8, "eleven"]],
+                                        [["10.0.0.0", 8]]),
+                       { added: 2, deleted: 1 }, "applyDiff during walk");
+  });
+  assert.deepEqual(seen, ["10.0.0.0/8", "10.1.0.0/16"], "walk saw old routes");
+  assert.equal(diffed.find("10.1.2.3"), "new", "applyDiff replaced");
+  assert.equal(diffed.find("10.2.3.4"), undefined, "applyDiff deleted");
+  diffed.findManyAsync(new Uint32Array([0x0a010203, 0x0b000001]), function(err, ids) {
+    assert.ifError(err);
+    assert.equal(diffed.value(ids[0]), "new", "async saw old table");
+    assert.equal(diffed.value(ids[1]), "eleven", "async deleted route keeps its value");
+  });
+  diffed.applyDiff(null, [["11.0.0.0", 8]]);
+  diffed.applyDiff([["10.1.0.0", 16, "newer"]]);
+  assert.equal(diffed.find("10.1.2.3"), "newer", "applyDiff with async in flight");
+  assert.equal(diffed.find("11.0.0.1"), undefined, "applyDiff delete in flight");
+  var readded = new iptrie.IPTrie();
+  readded.add("10.0.0.0", 8, { a: 1 });
+  readded.add("10.0.0.0", 8, { b: 2 });
+  assert.strictEqual(readded.value(1), undefined, "re-add frees the replaced value");
+  readded.del("10.0.0.0", 8);
+  assert.strictEqual(readded.value(2), undefined, "del frees the value");
+  readded.addBulk("10.0.0.0/8 a\n10.0.0.0/8 b\n");
+  assert.equal(readded.find("10.1.1.1"), "b", "addBulk repeat replaces");
+  assert.deepEqual([readded.value(1), readded.value(2)].sort(), ["b", undefined],
+                   "addBulk repeat frees the replaced value");
+  var settled = new iptrie.IPTrie();
+  settled.add("10.1.0.0", 16, "newer");
+  settled.add("2001:db8::", 32, "doc");
+  assert.equal(diffed.freeze().byteLength, settled.freeze().byteLength,
+               "image leaves out nodes awaiting release");
+
+  var redundant = new iptrie.IPTrie({ valueMode: "intern" });
+  redundant.add("192.168.0.0", 24, "lan");
+  redundant.add("192.168.1.0", 24, "lan");
+  redundant.add("192.168.1.128", 25, "lan");
+  redundant.add("192.168.2.0", 24, "other");
+  redundant.add("2001:db8::", 32, "doc");
+  redundant.add("2001:db8:1::", 48, "doc");
+  var optimized = redundant.optimize();
+  assert.equal(optimized.removed, 3, "optimize removed");
+  assert.ok(optimized.nodes.after < optimized.nodes.before, "optimize nodes");
+  assert.deepEqual(redundant.findAll("192.168.1.200").map(function(r) { return r.length; }),
+                   [23], "optimize merged");
+  assert.equal(redundant.find("192.168.0.1"), "lan", "optimize kept lan");
+  assert.equal(redundant.find("192.168.2.1"), "other", "optimize kept other");
+  assert.equal(redundant.find("2001:db8:1::1"), "doc", "optimize kept doc");
+  assert.equal(redundant.optimize().removed, 0, "optimize is idempotent");
+
+  var logs = Buffer.from("10.120.2.1 - GET /\n" +
+                        "2001:470:0:76::2 - GET /x\r\n" +
+                        "1.2.3.4 - GET /\n" +
+                        "garbage\n" +
+                        "x 75.49.14.236");
+  assert.equal(lookup.annotate(logs).toString(),
+               "10.120.2.1 - GET / rfc1918\n" +
+               "2001:470:0:76::2 - GET /x website\r\n" +
+               "1.2.3.4 - GET / -\n" +
+               "garbage -\n" +
+               "x 75.49.14.236 -", "annotate");
+  var reused = Buffer.alloc(256);
+  var annotated = lookup.annotate(Buffer.from("a 75.49.14.236\n"),
+                                  { field: 1, separator: "\t", missing: "?", output: reused });
+  assert.equal(annotated.toString(), "a 75.49.14.236\tboom\n", "annotate options");
+  assert.equal(annotated.buffer, reused.buffer, "annotate reused output");
+  assert.equal(lookup.annotate(Buffer.from("75.49.14.236\n"), { output: Buffer.alloc(4) }).toString(),
+               "75.49.14.236 boom\n", "annotate output overflow");
+  var streamed = [];
+  var annotator = lookup.annotateStream();
+  annotator.on('data', function(chunk) { streamed.push(chunk); });
+  annotator.on('end', function() {
+    assert.equal(Buffer.concat(streamed).toString(), "10.120.2.1 rfc1918\n75.49.14.236 boom",
+                 "annotateStream");
+  });
+  annotator.write("10.120.");
+  annotator.write("2.1\n75.49");
+  annotator.end(".14.236");
+
+  var tallied = new iptrie.IPTrie();
+  tallied.add("10.0.0.0", 8, "a");
+  tallied.add("10.1.0.0", 16, "b");
+  tallied.add("10.2.0.0", 16, "c");
+  tallied.add("2001:db8::", 32, "d");
+  tallied.del("2001:db8::", 32);
+  tallied.find("10.1.1.1");
+  tallied.findMany(["10.2.1.1", "11.0.0.1"]);
+  var stats = tallied.stats();
+  assert.deepEqual(stats.counters, { add: 4, del: 1, find: 3, hit: 2, miss: 1 }, "stats counters");
+  assert.equal(stats.ipv4.routes, 3, "stats routes");
+  assert.equal(stats.ipv4.nodes, stats.ipv4.routes + stats.ipv4.incidental, "stats nodes");
+  assert.deepEqual(stats.ipv4.depth, [1, 1, 2], "stats depth");
+  assert.equal(stats.ipv4.maxPath, 3, "stats maxPath");
+  assert.equal(stats.ipv6.nodes, 0, "stats empty family");
+
+  var present = new iptrie.IPTrie({ valueMode: "integer" });
+  present.add("10.0.0.0", 8, 0);
+  present.add("2001:db8::", 32, 1);
+  assert.equal(present.has("10.1.2.3"), true, "has");
+  assert.equal(present.has(0x0a000001), true, "has number");
+  assert.equal(present.has("2001:db8::1"), true, "has IPv6");
+  assert.equal(present.has("11.0.0.1"), false, "has miss");
+  assert.equal(present.has("bogus"), false, "has unparsable");
+  assert.throws(function() { present.has(); }, TypeError, "has without address");
+  assert.equal(present.stats().counters.find, 4, "has counts finds");
+  assert.throws(function() { iptrie.IPTrie.prototype.find.call({}, "10.0.0.1"); },
+                TypeError, "illegal invocation");
+
+  var filtered = new iptrie.IPTrie({ prefilter: true });
+  filtered.add("10.0.0.0", 8, "rfc1918");
+  filtered.add("192.0.2.7", 32, "host");
+  filtered.add("2001:db8::", 48, "doc");
+  assert.equal(filtered.find("10.200.1.1"), "rfc1918", "prefilter hit");
+  assert.equal(filtered.find("192.0.2.7"), "host", "prefilter host");
+  assert.equal(filtered.find("192.0.2.8"), undefined, "prefilter near miss");
+  assert.equal(filtered.find("8.8.8.8"), undefined, "prefilter miss");
+  assert.equal(filtered.find("2001:db8:1::"), undefined, "prefilter IPv6 miss");
+  assert.deepEqual(filtered.findMany(["2001:db8::1", "11.0.0.1", "10.0.0.1"]),
+                   ["doc", null, "rfc1918"], "prefilter findMany");
+  filtered.del("192.0.2.7", 32);
+  assert.equal(filtered.find("192.0.2.7"), undefined, "prefilter after del");
+  filtered.compile();
+  assert.equal(filtered.find("10.1.1.1"), "rfc1918", "prefilter compiled hit");
+  assert.equal(filtered.find("9.1.1.1"), undefined, "prefilter compiled miss");
+
+  var published = require('os').tmpdir() + "/iptrie-pub-" + process.pid + ".img";
+  var publisher = new iptrie.IPTrie();
+  publisher.add("10.0.0.0", 8, "first");
+  var generation = publisher.publish(published);
+  var subscriber = iptrie.IPTrie.subscribe(published);
+  assert.equal(subscriber.generation(), generation, "subscribe generation");
+  assert.equal(subscriber.find("10.1.1.1"), "first", "subscribe find");
+  assert.throws(function() { subscriber.add("1.0.0.0", 8, "x"); }, "subscriber read-only");
+  publisher.add("10.0.0.0", 8, "second");
+  publisher.add("192.0.2.0", 24, "new");
+  assert.equal(publisher.publish(published), generation + 1, "publish bumps generation");
+  assert.equal(subscriber.find("10.1.1.1"), "second", "subscriber reloads");
+  assert.equal(subscriber.has("192.0.2.1"), true, "subscriber sees new routes");
+  assert.equal(subscriber.generation(), generation + 1, "subscriber generation");
+  assert.throws(function() { iptrie.IPTrie.subscribe(published + ".missing"); },
+                /not been published/, "subscribe unpublished");
+  require('fs').unlinkSync(published);
+  require('fs').unlinkSync(published + ".gen");
+
+  [false, true].forEach(function(precompute) {
+    var lists = new iptrie.IPTrie({ valueMode: "lists", precompute: precompute });
+    lists.add("10.0.0.0", 8, 0);
+    lists.add("10.20.0.0", 16, 3);
+    lists.add("10.20.0.0", 16, 63);
+    lists.add("10.20.30.0", 24, 1);
+    lists.add("2001:db8::", 32, 5);
+    lists.add("2001:db8:0:1::", 64, 6);
+    assert.equal(lists.classify("10.20.30.40"), 0x800000000000000bn, "classify nested");
+    assert.equal(lists.classify("10.1.1.1"), 1n, "classify outer");
+    assert.equal(lists.classify("11.1.1.1"), 0n, "classify miss");
+    assert.equal(lists.classify("2001:db8:0:1::1"), 0x60n, "classify IPv6");
+    assert.equal(lists.find("10.20.1.1"), 0x8000000000000008n, "lists find");
+    assert.equal(lists.del("10.20.0.0", 16, 4), false, "del absent list");
+    assert.equal(lists.del("10.20.0.0", 16, 63), true, "del one list");
+    assert.equal(lists.classify("10.20.30.40"), 0xbn, "classify after del list");
+    lists.add("10.0.0.0", 8, 2);
+    assert.equal(lists.classify("10.20.30.40"), 0xfn, "classify after covering add");
+    assert.equal(lists.del("10.20.0.0", 16), true, "del route");
+    assert.equal(lists.classify("10.20.30.40"), 0x7n, "classify after del route");
+    assert.throws(function() { lists.add("1.0.0.0", 8, 64); }, /0 to 63/, "list range");
+    assert.throws(function() { lists.optimize(); }, /lists mode/, "lists optimize");
+  });
+  assert.throws(function() { lookup.classify("10.0.0.1"); }, /lists/, "classify needs lists");
+
+  var counted = new iptrie.IPTrie({ counters: true, cache: 64 });
+  counted.add("10.0.0.0", 8, "customer a");
+  counted.add("10.1.0.0", 16, "customer b");
+  counted.add("2001:db8::", 32, "customer c");
+  counted.find("10.1.2.3", 1500);
+  counted.find("10.1.2.3", 40);
+  assert.equal(counted.has("10.9.9.9", 100), true, "counted has");
+  counted.find("192.0.2.1", 60);
+  counted.findMany(["10.2.0.1", "2001:db8::1", "192.0.2.1"], new Uint32Array([10, 20, 30]));
+  var drained = counted.drainCounters().map(function(r) {
+    return [r.prefix, r.length, r.value, r.packets, r.bytes];
+  });
+  assert.deepEqual(drained, [["10.0.0.0", 8, "customer a", 2, 110],
+                             ["10.1.0.0", 16, "customer b", 2, 1540],
+                             ["2001:db8::", 32, "customer c", 1, 20]], "drainCounters");
+  assert.deepEqual(counted.drainCounters(), [], "drainCounters resets");
+  assert.throws(function() { counted.findMany(["10.0.0.1"], new Uint32Array(2)); },
+                /one per address/, "counters bytes length");
+  assert.throws(function() { lookup.drainCounters(); }, /counters/, "drainCounters needs counters");
+  var metered = new iptrie.IPTrie({ valueMode: "intern", counters: true });
+  assert.equal(metered.addBulk("10.0.0.0/8 foo\n10.1.0.0/16 foo\n2001:db8::/32 bar\n"), 3,
+               "intern counters addBulk");
+  assert.equal(metered.find("10.1.2.3", 100), "foo", "intern counters find");
+  assert.equal(metered.has("2001:db8::1", 60), true, "intern counters has");
+  assert.deepEqual(metered.drainCounters().map(function(r) {
+    return [r.prefix, r.length, r.value, r.packets, r.bytes];
+  }), [["10.1.0.0", 16, "foo", 1, 100], ["2001:db8::", 32, "bar", 1, 60]],
+                   "intern counters drain");
+
+  var churned = new iptrie.IPTrie({ dir24: true });
+  for (var c = 0; c < 4096; c++) churned.add("10." + (c >> 4) + "." + (c & 15) * 16 + ".0", 20 + (c & 7), c);
+  for (c = 0; c < 4096; c += 3) churned.del("10." + (c >> 4) + "." + (c & 15) * 16 + ".0", 20 + (c & 7));
+  churned.add("2001:db8::", 32, "v6");
+  var compacted = churned.compact();
+  assert.ok(compacted.after <= compacted.before, "compact frees churn");
+  assert.equal(churned.find("10.1.16.1"), 17, "compact keeps routes");
+  assert.equal(churned.find("10.1.32.1"), null, "compact keeps deletes");
+  assert.equal(churned.find("2001:db8::1"), "v6", "compact IPv6");
+  churned.add("10.1.32.0", 24, "again");
+  assert.equal(churned.find("10.1.32.1"), "again", "compact stays mutable");
+  assert.equal(churned.del("10.1.16.0", 21), true, "del after compact");
+  assert.equal(churned.find("10.1.16.1"), null, "find after del after compact");
+});